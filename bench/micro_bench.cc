@@ -0,0 +1,135 @@
+// Microbenchmarks of oinbs's per-file and per-command hot paths.
+// Compile it with the following command:
+// g++ -std=c++20 -O2 -o micro_bench micro_bench.cc
+//
+// Usage: ./micro_bench [--filter=SUBSTRING] [--min-time-ms=N] [--output=FILE]
+// Every benchmark runs until `--min-time-ms` has passed, and reports time and heap allocations per operation.
+#include "../oinbs.hpp"
+#include <chrono>
+#include <new>
+
+// GCC can't tell that `free` below only sees pointers from `malloc` in the replaced `operator new`.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// Heap allocations of the whole process, counted by the replaced global `operator new`.
+static std::atomic<std::uint64_t> g_allocations { 0 };
+
+void *operator new(std::size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+struct Config {
+    std::string filter;
+    std::uint64_t min_time_ms = 200;
+    std::string output;
+};
+
+struct Result {
+    std::string name;
+    std::uint64_t iterations = 0;
+    double ns_per_op = 0;
+    double allocations_per_op = 0;
+};
+
+static Config parse_config(int argc, char **argv) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        auto eq = arg.find('=');
+        auto key = arg.substr(0, eq);
+        std::string value(eq == std::string_view::npos ? "" : arg.substr(eq + 1));
+        if (key == "--filter") config.filter = value;
+        else if (key == "--min-time-ms") config.min_time_ms = std::stoul(value);
+        else if (key == "--output") config.output = value;
+        else throw std::runtime_error(std::format("Unknown option {}", arg));
+    }
+    return config;
+}
+
+// Keeps results of benchmarked calls alive, so they aren't optimized away.
+static volatile std::size_t g_sink;
+
+// Run `fn` in growing batches until `min_time_ms` has passed.
+template <typename Fn>
+static Result measure(std::string name, std::uint64_t min_time_ms, Fn&& fn) {
+    using clock = std::chrono::steady_clock;
+    fn();
+    std::uint64_t batch = 1, iterations = 0, allocations = 0;
+    clock::duration elapsed {};
+    while (elapsed < std::chrono::milliseconds(min_time_ms)) {
+        auto allocations_before = g_allocations.load(std::memory_order_relaxed);
+        auto start = clock::now();
+        for (std::uint64_t i = 0; i < batch; i++) {
+            fn();
+        }
+        elapsed += clock::now() - start;
+        allocations += g_allocations.load(std::memory_order_relaxed) - allocations_before;
+        iterations += batch;
+        batch *= 2;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return { std::move(name), iterations, static_cast<double>(ns) / iterations, static_cast<double>(allocations) / iterations };
+}
+
+int main(int argc, char **argv) {
+    using namespace oinbs;
+    // `execute_command` would log every spawn.
+    g_log_level = LogLevel::Warning;
+
+    guard_exception([&] {
+        auto config = parse_config(argc, argv);
+        std::vector<std::string> command { "g++", "-c", "-o", "build/obj/src$Pserver$Pmain$dcc.o", "-O2", "-g", "-Wall", "-Wextra",
+            "-Iinclude", "-Ithird party/include", "-DNAME=\"value\"", "-MMD", "-MF", "build/obj/src$Pserver$Pmain$dcc.d", "src/server/main.cc" };
+        std::string flags = "-O2 -g -Wall -Wextra -Iinclude -I/usr/include/glib-2.0 -DNDEBUG -pthread -fno-exceptions";
+        std::string path = "src/server/handlers/http_request_handler.cc";
+        std::vector<std::string> args { "-O2", "-g", "-Wall", "-Iinclude", "-MMD", "-MF", "build/obj/x.d" };
+        CompilationDatabase compdb;
+        for (int i = 0; i < 1000; i++) {
+            auto src = std::format("src/module{}/file{}.cc", i / 50, i);
+            compdb.compile_cxx_source(src, generate_obj_name(src), args, false);
+        }
+
+        std::vector<std::pair<std::string, std::function<void()>>> benchmarks {
+            { "render_command", [&] { g_sink = render_command(command).size(); } },
+            { "parse_flags", [&] { g_sink = parse_flags(flags).size(); } },
+            { "escape_string", [&] { g_sink = escape_string(path).size(); } },
+            { "generate_compilation_argv", [&] { g_sink = generate_compilation_argv(true, path, "build/obj/x.o", args, false).size(); } },
+            { "generate_obj_name", [&] { g_sink = generate_obj_name(path).size(); } },
+            { "generate_database_1000", [&] { g_sink = compdb.generate_database().size(); } },
+            { "execute_command_true", [&] { g_sink = execute_command({ "/bin/true" }).ret_code; } },
+        };
+
+        std::vector<Result> results;
+        for (auto& [name, fn] : benchmarks) {
+            if (!config.filter.empty() && name.find(config.filter) == std::string::npos) continue;
+            results.push_back(measure(name, config.min_time_ms, fn));
+            std::cerr << std::format("{}: {:.1f} ns/op, {:.1f} allocations/op\n", name, results.back().ns_per_op, results.back().allocations_per_op);
+        }
+
+        std::string json = std::format("{{\"oinbs_version\": {}, \"min_time_ms\": {}, \"benchmarks\": [", json_string(OINBS_VERSION), config.min_time_ms);
+        for (std::size_t i = 0; i < results.size(); i++) {
+            const auto& result = results[i];
+            json += std::format("{}{{\"name\": {}, \"iterations\": {}, \"ns_per_op\": {:.1f}, \"allocations_per_op\": {:.2f}}}",
+                i ? ", " : "", json_string(result.name), result.iterations, result.ns_per_op, result.allocations_per_op);
+        }
+        json += "]}";
+        if (config.output.empty()) {
+            std::cout << json << '\n';
+        } else {
+            std::ofstream ofs(config.output);
+            ofs << json << '\n';
+        }
+    });
+}
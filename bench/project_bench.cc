@@ -0,0 +1,196 @@
+// End-to-end benchmark of oinbs building a synthetic project.
+// Compile it with the following command:
+// g++ -std=c++20 -o project_bench project_bench.cc
+//
+// Usage: ./project_bench [--sources=N] [--headers=M] [--fanout=F] [--targets=T] [--dir=PATH] [--output=FILE] [--fake-compiler]
+// `--fake-compiler` replaces the compiler with this very program, which only writes the output and the depfile,
+// so the numbers show overhead of oinbs itself instead of the compiler.
+#include "../oinbs.hpp"
+#include <chrono>
+#include <set>
+
+namespace fs = std::filesystem;
+
+struct Config {
+    std::size_t sources = 200;
+    std::size_t headers = 50;
+    std::size_t fanout = 5;
+    std::size_t targets = 4;
+    std::string dir = "bench_project";
+    std::string output;
+    bool fake_compiler = false;
+};
+
+// Quoted includes of `path`, followed transitively through `include_dirs`.
+static void collect_includes(const fs::path& path, const std::vector<fs::path>& include_dirs, std::set<std::string>& seen) {
+    std::ifstream ifs(path);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (!line.starts_with("#include \"")) continue;
+        auto name = line.substr(10, line.find('"', 10) - 10);
+        for (const auto& dir : include_dirs) {
+            auto header = dir / name;
+            if (!fs::exists(header)) continue;
+            if (seen.insert(header.string()).second) collect_includes(header, include_dirs, seen);
+            break;
+        }
+    }
+}
+
+// Acts as a compiler that only creates the file after `-o`, and the depfile after `-MF`,
+// so header changes invalidate objects just like with a real compiler.
+static int fake_compile(int argc, char **argv) {
+    std::string output, depfile;
+    std::vector<fs::path> include_dirs;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) output = argv[++i];
+        else if (arg == "-MF" && i + 1 < argc) depfile = argv[++i];
+        else if (arg.starts_with("-I")) include_dirs.emplace_back(arg.substr(2));
+    }
+    if (output.empty()) return 0;
+    std::ofstream ofs(output);
+    ofs << "FAKE OBJECT";
+    if (!ofs) return 1;
+    if (!depfile.empty()) {
+        std::string src = argv[argc - 1];
+        std::set<std::string> headers;
+        collect_includes(src, include_dirs, headers);
+        std::ofstream dep(depfile);
+        dep << output << ": " << src;
+        for (const auto& header : headers) {
+            dep << " \\\n  " << header;
+        }
+        dep << '\n';
+        if (!dep) return 1;
+    }
+    return 0;
+}
+
+static Config parse_config(int argc, char **argv) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        auto eq = arg.find('=');
+        auto key = arg.substr(0, eq);
+        std::string value(eq == std::string_view::npos ? "" : arg.substr(eq + 1));
+        if (key == "--sources") config.sources = std::stoul(value);
+        else if (key == "--headers") config.headers = std::stoul(value);
+        else if (key == "--fanout") config.fanout = std::stoul(value);
+        else if (key == "--targets") config.targets = std::stoul(value);
+        else if (key == "--dir") config.dir = value;
+        else if (key == "--output") config.output = value;
+        else if (key == "--fake-compiler") config.fake_compiler = true;
+        else throw std::runtime_error(std::format("Unknown option {}", arg));
+    }
+    if (!config.targets || !config.headers || config.sources < config.targets) {
+        throw std::runtime_error("Need at least one header, one target and one source per target");
+    }
+    return config;
+}
+
+// Header i includes header i/2, so header 0 is included by everything transitively.
+static void generate_project(const Config& config) {
+    if (fs::exists(config.dir)) fs::remove_all(config.dir);
+    fs::create_directories(fs::path(config.dir) / "include");
+
+    for (std::size_t i = 0; i < config.headers; i++) {
+        std::ofstream ofs(fs::path(config.dir) / "include" / std::format("h{}.hpp", i));
+        ofs << "#pragma once\n";
+        if (i) ofs << std::format("#include \"h{}.hpp\"\n", i / 2);
+        ofs << std::format("inline int header_{}(int x) {{ return x * {} + 1; }}\n", i, i + 1);
+    }
+
+    std::uint64_t seed = 42;
+    auto next_random = [&seed] {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return seed >> 33;
+    };
+    auto per_target = config.sources / config.targets;
+    for (std::size_t t = 0; t < config.targets; t++) {
+        auto dir = fs::path(config.dir) / std::format("t{}", t);
+        fs::create_directories(dir);
+        for (std::size_t i = 0; i < per_target; i++) {
+            std::ofstream ofs(dir / std::format("s{}.cc", i));
+            for (std::size_t k = 0; k < config.fanout; k++) {
+                ofs << std::format("#include \"h{}.hpp\"\n", next_random() % config.headers);
+            }
+            if (i == 0) {
+                ofs << "int main() { return 0; }\n";
+            } else {
+                ofs << std::format("int source_{}_{}() {{ return header_0({}); }}\n", t, i, i);
+            }
+        }
+    }
+}
+
+// Build every target once, returning milliseconds spent.
+static std::uint64_t build_all(const Config& config) {
+    using namespace oinbs;
+    // Every phase stands for a separate run of a build script.
+    g_stat_cache.clear();
+    auto start = std::chrono::steady_clock::now();
+    CompilationDatabase compdb;
+    for (std::size_t t = 0; t < config.targets; t++) {
+        Target(std::format("t{}", t), std::format("build/t{}", t))
+            .add_include_directory("include")
+            .add_source_dir(std::format("t{}", t))
+            .build(compdb);
+    }
+    return elapsed_ms(start);
+}
+
+// The kernel stamps the file like files written afterwards. `clock::now()` is finer than its coarse timestamps, so
+// objects compiled right after could look older than the touched file.
+static void touch(const fs::path& path) {
+    if (utimensat(AT_FDCWD, path.c_str(), nullptr, 0)) {
+        throw std::runtime_error(std::format("Cannot touch {}", path.string()));
+    }
+}
+
+int main(int argc, char **argv) {
+    if (std::getenv("OINBS_BENCH_FAKE_COMPILER")) {
+        return fake_compile(argc, argv);
+    }
+
+    using namespace oinbs;
+    go_rebuild_urself(argc, argv);
+    // The project is built from its own directory.
+    g_build_script_name = fs::absolute(g_build_script_name).string();
+
+    guard_exception([&] {
+        auto config = parse_config(argc, argv);
+        if (config.fake_compiler) {
+            auto self = fs::absolute(argv[0]).string();
+            setenv("OINBS_BENCH_FAKE_COMPILER", "1", 1);
+            setenv("CC", self.c_str(), 1);
+            setenv("CXX", self.c_str(), 1);
+        }
+
+        log("INFO", "Generating project with {} sources, {} headers in {}", config.sources, config.headers, config.dir);
+        generate_project(config);
+        auto cwd = fs::current_path();
+        fs::current_path(config.dir);
+
+        auto full = build_all(config);
+        auto noop = build_all(config);
+        touch("include/h0.hpp");
+        auto header_touch = build_all(config);
+        touch("t0/s1.cc");
+        auto source_touch = build_all(config);
+
+        fs::current_path(cwd);
+
+        auto json = std::format(
+            "{{\"oinbs_version\": {}, \"config\": {{\"sources\": {}, \"headers\": {}, \"fanout\": {}, \"targets\": {}, \"jobs\": {}, \"fake_compiler\": {}}}, "
+            "\"results_ms\": {{\"full_build\": {}, \"noop_build\": {}, \"header_touch\": {}, \"source_touch\": {}}}}}",
+            json_string(OINBS_VERSION), config.sources, config.headers, config.fanout, config.targets, get_max_jobs(), config.fake_compiler ? "true" : "false",
+            full, noop, header_touch, source_touch);
+        if (config.output.empty()) {
+            std::cout << json << '\n';
+        } else {
+            std::ofstream ofs(config.output);
+            ofs << json << '\n';
+        }
+    });
+}
@@ -13,6 +13,7 @@
 
 #if defined(__cplusplus)
 #include <unordered_map>
+#include <unordered_set>
 #include <type_traits>
 #include <string>
 #include <source_location>
@@ -21,15 +22,45 @@
 #include <format>
 #include <stdexcept>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
 #include <exception>
 #include <iostream>
 #include <fstream>
 #include <string_view>
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <coroutine>
 #ifdef _WIN32
 #error No windows support yet.
 #else
 #include <unistd.h>
+#include <fcntl.h>
+extern char **environ;
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
 #endif
+#endif
+
+#define OINBS_VERSION "0.1.0"
 
 #define OINBS_NAMESPACE_BEGIN namespace oinbs {
 #define OINBS_NAMESPACE_END }
@@ -45,6 +76,14 @@ OINBS_NAMESPACE_BEGIN
 
 // {{{ Global Variables
 inline std::string g_build_script_name = "\\/\\/";
+// Source file of the build script, set by `go_rebuild_urself`.
+inline std::string g_build_script_source;
+
+// Maximum number of jobs running at the same time. 0 means deciding by `OINBS_JOBS` or number of hardware threads.
+inline std::size_t g_max_jobs = 0;
+// Number of failed jobs after which no more jobs are started, 0 means keeping going regardless.
+// 1 is fail-fast, where running jobs are cancelled as well. Unset means deciding by `OINBS_KEEP_GOING`, defaulting to 1.
+inline std::optional<std::size_t> g_keep_going;
 // }}}
 
 // {{{ Utilities
@@ -79,11 +118,150 @@ inline std::string escape_string(std::string_view str) {
     return result;
 }
 
+// Quote `str` as a JSON string, control characters included.
+inline std::string json_string(std::string_view str) {
+    std::string result = "\"";
+    for (auto ch : str) {
+        switch (ch) {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\t': result += "\\t"; break;
+            case '\r': result += "\\r"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    result += std::format("\\u{:04x}", static_cast<int>(ch));
+                } else {
+                    result += ch;
+                }
+        }
+    }
+    return result + "\"";
+}
+
+// Result of stat-ing a path.
+struct FileStat {
+    bool exists = false;
+    bool is_directory = false;
+    // Modification time in nanoseconds since epoch.
+    std::int64_t mtime = 0;
+};
+
+// Stat `path` with a single syscall.
+inline FileStat stat_file(const char *path) {
+    FileStat result;
+#if defined(__linux__) && defined(STATX_MTIME)
+    struct statx stx;
+    if (statx(AT_FDCWD, path, 0, STATX_TYPE | STATX_MTIME, &stx) != 0) return result;
+    result.exists = true;
+    result.is_directory = S_ISDIR(stx.stx_mode);
+    result.mtime = static_cast<std::int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+#else
+    struct stat st;
+    if (::stat(path, &st) != 0) return result;
+    result.exists = true;
+    result.is_directory = S_ISDIR(st.st_mode);
+#ifdef __MACH__
+    result.mtime = static_cast<std::int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    result.mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    return result;
+}
+
+// Stat results shared by every up-to-date check of a run, so each path is stat-ed only once.
+// Outputs produced by oinbs are invalidated automatically. Files modified behind oinbs' back while
+// the build script is running are only noticed after `clear()`.
+class StatCache {
+    std::mutex m_mutex;
+    std::unordered_map<std::string, FileStat> m_entries;
+
+    public:
+    FileStat get(const std::string& path) {
+        {
+            std::lock_guard lock(m_mutex);
+            auto it = m_entries.find(path);
+            if (it != m_entries.end()) return it->second;
+        }
+        auto result = stat_file(path.c_str());
+        std::lock_guard lock(m_mutex);
+        m_entries[path] = result;
+        return result;
+    }
+
+    FileStat get(std::string_view path) {
+        return get(std::string { path });
+    }
+
+    FileStat get(const std::filesystem::path& path) {
+        return get(path.string());
+    }
+
+    bool exists(const std::filesystem::path& path) {
+        return get(path.string()).exists;
+    }
+
+    // Forget about `path`, should be called after it's written.
+    void invalidate(const std::string& path) {
+        std::lock_guard lock(m_mutex);
+        m_entries.erase(path);
+    }
+
+    void invalidate(const std::filesystem::path& path) {
+        invalidate(path.string());
+    }
+
+    // Forget about everything.
+    void clear() {
+        std::lock_guard lock(m_mutex);
+        m_entries.clear();
+    }
+};
+
+inline StatCache g_stat_cache;
+
 // Checks if file a is newer than file b.
 inline bool is_newer(std::string_view a, std::string_view b) {
-    auto a_time = std::filesystem::last_write_time(a);
-    auto b_time = std::filesystem::last_write_time(b);
-    return a_time > b_time;
+    auto a_stat = g_stat_cache.get(a);
+    auto b_stat = g_stat_cache.get(b);
+    if (!a_stat.exists || !b_stat.exists) {
+        throw std::runtime_error(std::format("Cannot get modification time of {}", a_stat.exists ? b : a));
+    }
+    return a_stat.mtime > b_stat.mtime;
+}
+
+// Mix `value` into hash `seed`.
+inline std::uint64_t hash_combine(std::uint64_t seed, std::uint64_t value) {
+    seed ^= value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+    return seed;
+}
+
+// Hash bytes of `data`, processing 8 bytes at a time.
+inline std::uint64_t hash_bytes(std::string_view data, std::uint64_t seed = 0xcbf29ce484222325ull) {
+    std::size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data.data() + i, 8);
+        seed = (seed ^ word) * 0x100000001b3ull;
+        seed ^= seed >> 29;
+    }
+    for (; i < data.size(); i++) {
+        seed = (seed ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ull;
+    }
+    return hash_combine(seed, data.size());
+}
+
+// Hash content of file `path`.
+inline std::uint64_t hash_file(const std::string& path) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) throw std::runtime_error(std::format("Cannot read {}", path));
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    std::string buffer(1 << 16, '\0');
+    while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount() > 0) {
+        hash = hash_bytes(std::string_view(buffer.data(), ifs.gcount()), hash);
+    }
+    return hash;
 }
 
 inline std::string get_cc() {
@@ -96,9 +274,302 @@ inline std::string get_cxx() {
     return cxx ? cxx : "cxx";
 }
 
+// Full path of executable `name` found in `$PATH`.
+inline std::optional<std::string> find_program(std::string_view name) {
+    auto path = std::getenv("PATH");
+    if (!path) return std::nullopt;
+    std::string_view dirs { path };
+    while (!dirs.empty()) {
+        auto sep = dirs.find(':');
+        auto dir = dirs.substr(0, sep);
+        dirs = sep == std::string_view::npos ? "" : dirs.substr(sep + 1);
+        auto candidate = (std::filesystem::path(dir.empty() ? "." : dir) / name).string();
+        if (access(candidate.c_str(), X_OK) == 0) return candidate;
+    }
+    return std::nullopt;
+}
+
+inline std::string get_ar() {
+    auto ar = std::getenv("AR");
+    return ar ? ar : "ar";
+}
+
+// Get maximum number of concurrent jobs.
+inline std::size_t get_max_jobs() {
+    if (g_max_jobs) return g_max_jobs;
+    if (auto jobs = std::getenv("OINBS_JOBS")) {
+        auto n = std::strtoul(jobs, nullptr, 10);
+        if (n) return n;
+    }
+    auto n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Get number of failed jobs after which building stops, see `g_keep_going`.
+inline std::size_t get_keep_going() {
+    if (g_keep_going) return *g_keep_going;
+    if (auto keep_going = std::getenv("OINBS_KEEP_GOING")) {
+        return std::strtoul(keep_going, nullptr, 10);
+    }
+    return 1;
+}
+
+// Apply options shared by every build script, `-j N` for `g_max_jobs` and `-k N` for `g_keep_going`.
+// Returns the remaining arguments, without the program name.
+inline std::vector<std::string> parse_build_options(int argc, char **argv) {
+    std::vector<std::string> rest;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg.size() < 2 || (arg.substr(0, 2) != "-j" && arg.substr(0, 2) != "-k")) {
+            rest.emplace_back(arg);
+            continue;
+        }
+        auto value = arg.size() > 2 ? std::string(arg.substr(2)) : (i + 1 < argc ? std::string(argv[++i]) : std::string());
+        char *end = nullptr;
+        auto number = std::strtoul(value.c_str(), &end, 10);
+        if (value.empty() || *end) {
+            throw std::runtime_error(std::format("Option {} expects a number", arg.substr(0, 2)));
+        }
+        if (arg[1] == 'j') {
+            g_max_jobs = number;
+        } else {
+            g_keep_going = number;
+        }
+    }
+    return rest;
+}
+
 // Log stuff.
+
+// Severity of log messages.
+enum class LogLevel {
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off,
+};
+
+// Map level names used with `log` (`DEBUG`, `INFO`, `WARNING`, `ERROR`) to `LogLevel`. Unknown names are `Info`.
+constexpr LogLevel parse_log_level(std::string_view level) {
+    if (level == "DEBUG") return LogLevel::Debug;
+    if (level == "WARNING") return LogLevel::Warning;
+    if (level == "ERROR") return LogLevel::Error;
+    if (level == "OFF") return LogLevel::Off;
+    return LogLevel::Info;
+}
+
+inline LogLevel default_log_level() {
+    auto level = std::getenv("OINBS_LOG_LEVEL");
+    return level ? parse_log_level(level) : LogLevel::Info;
+}
+
+// Messages below this level are dropped without being formatted. Could be set by `OINBS_LOG_LEVEL`.
+inline LogLevel g_log_level = default_log_level();
+
+// Writes log messages to stderr from a background thread.
+// Producers push messages into a lock-free intrusive MPSC queue (Vyukov's), the writer drains it and
+// writes each batch with a single call. Producers only touch a mutex when the writer is asleep.
+// In quiet mode the writer also keeps a progress line at the bottom.
+class Logger {
+    struct Node {
+        std::atomic<Node*> next { nullptr };
+        std::string text;
+    };
+
+    std::atomic<Node*> m_head;
+    Node* m_tail;
+    Node m_stub;
+    std::atomic<std::uint64_t> m_pushed { 0 };
+    std::atomic<std::uint64_t> m_written { 0 };
+    std::atomic<bool> m_stop { false };
+    std::atomic<bool> m_sleeping { false };
+    std::mutex m_wait_mutex;
+    std::condition_variable m_wake_cv, m_flushed_cv;
+    std::once_flag m_started;
+    std::thread m_thread;
+
+    std::atomic<bool> m_progress_enabled { false };
+    std::atomic<std::uint64_t> m_progress_done { 0 };
+    std::atomic<std::uint64_t> m_progress_total { 0 };
+    bool m_progress_shown = false;
+    std::uint64_t m_progress_drawn = 0;
+
+    void m_push(Node* node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        auto prev = m_head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // Consumer side only. May return null while a producer is in the middle of pushing.
+    Node* m_pop() {
+        auto tail = m_tail;
+        auto next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (!next) return nullptr;
+            m_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        if (tail != m_head.load(std::memory_order_acquire)) return nullptr;
+        m_push(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+    void m_write(const std::string& text) {
+        std::size_t offset = 0;
+        while (offset < text.size()) {
+            auto size = ::write(STDERR_FILENO, text.data() + offset, text.size() - offset);
+            if (size <= 0) {
+                if (size == -1 && errno == EINTR) continue;
+                return;
+            }
+            offset += size;
+        }
+    }
+
+    // Drain the queue, returns whether anything was written.
+    bool m_drain() {
+        auto target = m_pushed.load(std::memory_order_acquire);
+        auto written = m_written.load(std::memory_order_relaxed);
+        std::string batch;
+        while (written < target) {
+            auto node = m_pop();
+            if (!node) {
+                std::this_thread::yield();
+                continue;
+            }
+            batch += node->text;
+            delete node;
+            written++;
+        }
+        if (!batch.empty() && m_progress_shown) {
+            batch.insert(0, "\r\033[K");
+            m_progress_shown = false;
+        }
+        auto progress = m_progress_enabled.load(std::memory_order_relaxed);
+        auto done = m_progress_done.load(std::memory_order_relaxed);
+        auto total = m_progress_total.load(std::memory_order_relaxed);
+        if (progress && total && (!m_progress_shown || done != m_progress_drawn)) {
+            batch += std::format("\r\033[K[{}/{}]", done, total);
+            m_progress_shown = true;
+            m_progress_drawn = done;
+        } else if (!progress && m_progress_shown) {
+            batch += "\n";
+            m_progress_shown = false;
+        }
+        if (!batch.empty()) m_write(batch);
+        m_written.store(written, std::memory_order_release);
+        {
+            std::lock_guard lock(m_wait_mutex);
+        }
+        m_flushed_cv.notify_all();
+        return !batch.empty();
+    }
+
+    void m_run() {
+        while (true) {
+            m_drain();
+            if (m_stop.load()) {
+                m_drain();
+                return;
+            }
+            std::unique_lock lock(m_wait_mutex);
+            m_sleeping.store(true);
+            m_wake_cv.wait(lock, [this] { return m_pushed.load() != m_written.load() || m_stop.load(); });
+            m_sleeping.store(false);
+        }
+    }
+
+    void m_notify() {
+        if (m_sleeping.load()) {
+            std::lock_guard lock(m_wait_mutex);
+            m_wake_cv.notify_one();
+        }
+    }
+
+    public:
+    Logger() : m_head(&m_stub), m_tail(&m_stub) {}
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    ~Logger() {
+        if (!m_thread.joinable()) return;
+        m_progress_enabled.store(false, std::memory_order_relaxed);
+        {
+            std::lock_guard lock(m_wait_mutex);
+            m_stop.store(true);
+        }
+        m_wake_cv.notify_one();
+        m_thread.join();
+    }
+
+    // Queue `text` (which should end with a newline) for writing.
+    void write(std::string text) {
+        std::call_once(m_started, [this] {
+            m_thread = std::thread([this] { m_run(); });
+        });
+        auto node = new Node;
+        node->text = std::move(text);
+        m_push(node);
+        m_pushed.fetch_add(1);
+        m_notify();
+    }
+
+    // Block until every message queued so far is written.
+    void flush() {
+        auto target = m_pushed.load();
+        std::unique_lock lock(m_wait_mutex);
+        m_flushed_cv.wait(lock, [&] { return m_written.load() >= target; });
+    }
+
+    // Show `done/total` on the progress line, only effective in quiet mode on a terminal.
+    void set_progress(std::uint64_t done, std::uint64_t total) {
+        if (!m_progress_enabled.load(std::memory_order_relaxed)) return;
+        m_progress_done.store(done, std::memory_order_relaxed);
+        m_progress_total.store(total, std::memory_order_relaxed);
+        write("");
+    }
+
+    // Enable or disable the progress line.
+    void enable_progress(bool enabled) {
+        if (m_progress_enabled.exchange(enabled) != enabled) {
+            write("");
+            flush();
+        }
+    }
+};
+
+inline Logger g_logger;
+
+inline bool log_enabled(LogLevel level) {
+    return level >= g_log_level && g_log_level != LogLevel::Off;
+}
+
+// Quiet mode only shows warnings and errors, and a single `[done/total]` progress line on terminals.
+inline void set_quiet(bool quiet) {
+    g_log_level = quiet ? LogLevel::Warning : default_log_level();
+    g_logger.enable_progress(quiet && isatty(STDERR_FILENO));
+}
+
 inline void log(std::string_view level, std::string_view fmt, auto&&... args) {
-    std::cerr << "[" << level << "] " << std::vformat(fmt, std::make_format_args(args...)) << "\n";
+    if (!log_enabled(parse_log_level(level))) return;
+    std::string text = "[";
+    text += level;
+    text += "] ";
+    text += std::vformat(fmt, std::make_format_args(args...));
+    text += '\n';
+    g_logger.write(std::move(text));
 }
 
 inline bool string_contains(std::string_view sv, char ch) {
@@ -140,6 +611,7 @@ inline void guard_exception(Fn&& f) requires std::is_invocable_v<Fn> {
         f();
     } catch (const std::exception& e) {
         log("ERROR", "Compilation stopped due to exception: {}", e.what());
+        g_logger.flush();
         std::exit(1);
     }
 }
@@ -193,6 +665,60 @@ static inline std::vector<std::string> get_env_flags(const char* name) {
     return {};
 }
 
+// Parses a Makefile style depfile emitted by `-MD`/`-MMD`, returning prerequisites of the first rule.
+inline std::vector<std::string> parse_depfile(std::string_view content) {
+    std::vector<std::string> result;
+    std::size_t idx = 0;
+
+    // Skip the target, which ends at the first colon followed by whitespace.
+    while (idx < content.size()) {
+        if (content[idx] == '\\' && idx + 1 < content.size()) {
+            idx += 2;
+            continue;
+        }
+        if (content[idx] == ':' && (idx + 1 == content.size() || std::isspace(content[idx + 1]))) {
+            idx++;
+            break;
+        }
+        idx++;
+    }
+
+    std::string buffer;
+    for (; idx < content.size(); idx++) {
+        char c = content[idx];
+        if (c == '\\' && idx + 1 < content.size()) {
+            char next = content[idx + 1];
+            if (next == '\n' || next == '\r') {
+                idx++;
+                continue;
+            }
+            if (next == ' ' || next == '#' || next == '\\') {
+                buffer += next;
+                idx++;
+                continue;
+            }
+            buffer += c;
+        } else if (c == '$' && idx + 1 < content.size() && content[idx + 1] == '$') {
+            buffer += '$';
+            idx++;
+        } else if (c == '\n' && !buffer.empty() && buffer.back() == ':') {
+            // Phony rules for headers start here.
+            break;
+        } else if (std::isspace(c)) {
+            if (!buffer.empty()) {
+                result.push_back(buffer);
+                buffer.clear();
+            }
+        } else {
+            buffer += c;
+        }
+    }
+    if (!buffer.empty() && buffer.back() != ':') {
+        result.push_back(buffer);
+    }
+    return result;
+}
+
 inline std::vector<std::string> walk_dir(std::filesystem::path path) {
     std::vector<std::string> result;
     if (!std::filesystem::exists(path) || !std::filesystem::is_directory(path)) {
@@ -228,6 +754,34 @@ inline bool is_c_header(std::string name) {
     return name.ends_with(".h");
 }
 
+// Check if input is a shared library.
+inline bool is_shared_library(std::string_view name) {
+    return name.ends_with(".so") || name.ends_with(".dylib") || name.ends_with(".dll");
+}
+
+// Generates object file name from a path.
+// This generates a unique name for every path, and always generates same name for the same path.
+inline std::string generate_obj_name(std::string_view path) {
+    std::string result;
+    for (auto ch : path) {
+        switch (ch) {
+            case '/': {
+                result += "$P";
+            } break;
+            case '$': {
+                result += "$$";
+            } break;
+            case '.': {
+                result += "$d";
+            } break;
+            default: {
+                result += ch;
+            } break;
+        }
+    }
+    return result + ".o";
+}
+
 // Strip file extension.
 inline std::string strip_file_extension(std::string_view filename) {
     auto idx = filename.find_last_of(".");
@@ -241,27 +795,197 @@ inline std::string strip_file_extension(std::string_view filename) {
 
 // {{{ Platform specific thingy
 
+// Resources used by child processes, as reported by `wait4`.
+struct ResourceUsage {
+    // Number of commands accounted.
+    std::uint64_t commands = 0;
+    // CPU time in user and kernel mode, in microseconds.
+    std::uint64_t user_time = 0;
+    std::uint64_t sys_time = 0;
+    // Peak resident set size in bytes, the largest of all commands.
+    std::uint64_t peak_memory = 0;
+    std::uint64_t minor_faults = 0;
+    std::uint64_t major_faults = 0;
+    std::uint64_t voluntary_switches = 0;
+    std::uint64_t involuntary_switches = 0;
+
+    void add(const ResourceUsage& other) {
+        commands += other.commands;
+        user_time += other.user_time;
+        sys_time += other.sys_time;
+        peak_memory = std::max(peak_memory, other.peak_memory);
+        minor_faults += other.minor_faults;
+        major_faults += other.major_faults;
+        voluntary_switches += other.voluntary_switches;
+        involuntary_switches += other.involuntary_switches;
+    }
+};
+
+// Usage of every command executed by the current thread is added here if it's set, `run_jobs` points it at the
+// running job's usage.
+inline thread_local ResourceUsage* g_job_usage = nullptr;
+
 // Structure represents the result of a command execution.
 struct CommandOutput {
     int ret_code;
     std::string stdout_content;
     std::string stderr_content;
+    // Peak resident set size of the child in bytes.
+    std::uint64_t peak_memory = 0;
+    // Whether the child was killed because it ran out of time.
+    bool timed_out = false;
+    ResourceUsage usage;
 };
 
 // Load executable and replace current process.
 inline void execute_nofork(char **argv) {
+    g_logger.flush();
     if (execvp(argv[0], argv) == -1) {
         throw std::runtime_error("Failed to spawn process");
     }
 }
 
+// Create a pipe whose ends won't leak into other children spawned concurrently.
+inline int make_cloexec_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds)) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+// Called with every complete line (including the newline) of a command's stderr while it runs.
+using LineHandler = std::function<void(std::string_view)>;
+
+// Less common knobs of `execute_command`.
+struct CommandOptions {
+    // Extra environment variables as `NAME=value`, overriding inherited ones.
+    std::vector<std::string> env;
+    // Kill the command with everything it spawned after this long, 0 means never.
+    std::chrono::milliseconds timeout { 0 };
+    // Working directory of the command, current one if empty.
+    std::string cwd;
+};
+
+// Environment of current process with `overrides` (`NAME=value`) applied.
+inline std::vector<std::string> make_environment(const std::vector<std::string>& overrides) {
+    std::vector<std::string> result;
+    for (char **entry = environ; *entry; entry++) {
+        std::string_view current = *entry;
+        auto name = current.substr(0, current.find('=') + 1);
+        bool overridden = std::any_of(overrides.begin(), overrides.end(), [&](const std::string& o) { return o.starts_with(name); });
+        if (!overridden) result.emplace_back(current);
+    }
+    result.insert(result.end(), overrides.begin(), overrides.end());
+    return result;
+}
+
+// Children currently running, so they could be cancelled together.
+// Cancellation of commands started by jobs of one `run_jobs` call, including nested calls made by its jobs.
+class CancelToken {
+    const CancelToken *m_parent;
+    std::atomic<bool> m_cancelled { false };
+
+    friend class RunningCommands;
+
+    public:
+    explicit CancelToken(const CancelToken *parent) : m_parent(parent) {}
+
+    bool cancelled() const {
+        for (auto token = this; token; token = token->m_parent) {
+            if (token->m_cancelled.load()) return true;
+        }
+        return false;
+    }
+
+    // Whether this token is `other` or nested in it.
+    bool within(const CancelToken *other) const {
+        for (auto token = this; token; token = token->m_parent) {
+            if (token == other) return true;
+        }
+        return false;
+    }
+};
+
+// Token of the `run_jobs` call the current thread runs a job of, null outside of jobs.
+inline thread_local const CancelToken *g_cancel_token = nullptr;
+
+class RunningCommands {
+    std::mutex m_mutex;
+    struct Child {
+        // Whether the child leads its own process group.
+        bool own_group;
+        const CancelToken *token;
+    };
+    std::unordered_map<pid_t, Child> m_children;
+
+    public:
+    // Register a child under the token of the current thread, cancelling it right away if the token is cancelled.
+    void add(pid_t pid, bool own_group) {
+        std::lock_guard lock(m_mutex);
+        m_children[pid] = { own_group, g_cancel_token };
+        if (g_cancel_token && g_cancel_token->cancelled()) kill(own_group ? -pid : pid, SIGTERM);
+    }
+
+    void remove(pid_t pid) {
+        std::lock_guard lock(m_mutex);
+        m_children.erase(pid);
+    }
+
+    // Terminate every running child registered under `token` or tokens nested in it, and every such child started
+    // while `token` is alive.
+    void cancel(CancelToken& token) {
+        std::lock_guard lock(m_mutex);
+        token.m_cancelled = true;
+        for (const auto& [pid, child] : m_children) {
+            if (child.token && child.token->within(&token)) kill(child.own_group ? -pid : pid, SIGTERM);
+        }
+    }
+
+    // Whether the job running on the current thread was cancelled.
+    bool cancelled() {
+        return g_cancel_token && g_cancel_token->cancelled();
+    }
+};
+
+inline RunningCommands g_running_commands;
+
+// Number of alive `InterruptGuard`s. Meanwhile children get their own process group, so cancelling them kills
+// everything they spawned, while signals from the terminal are handled by the guard.
+inline std::atomic<int> g_interrupt_guards { 0 };
+
 // Execute command using parameter `argv`.
-inline CommandOutput execute_command(const std::vector<std::string>& argv, bool redirect_output = true) {
-    log("INFO", "Executing command: {}", render_command(argv));
+// If `on_stderr_line` is set, stderr is also passed to it line by line as soon as it arrives.
+inline CommandOutput execute_command(const std::vector<std::string>& argv, bool redirect_output = true, const LineHandler& on_stderr_line = {}, const CommandOptions& options = {}) {
+    if (log_enabled(LogLevel::Info)) {
+        log("INFO", "Executing command: {}", render_command(argv));
+    }
+
+    // Prepare argv before forking, allocating in the child isn't safe once other threads exist.
+    std::vector<char*> c_argv;
+    for (const auto& arg : argv) {
+        c_argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    c_argv.push_back(nullptr);
+    std::vector<std::string> env;
+    std::vector<char*> c_env;
+    if (!options.env.empty()) {
+        env = make_environment(options.env);
+        for (const auto& entry : env) {
+            c_env.push_back(const_cast<char*>(entry.c_str()));
+        }
+        c_env.push_back(nullptr);
+    }
+
+    // Own process group, so a timeout or cancellation kills grandchildren as well.
+    bool own_group = options.timeout.count() || g_interrupt_guards.load() > 0;
 
     int pout[2], perr[2];
-    if (pipe(pout)) throw std::runtime_error("Cannot create pipe for stdout");
-    if (pipe(perr)) throw std::runtime_error("Cannot create pipe for stderr");
+    if (make_cloexec_pipe(pout)) throw std::runtime_error("Cannot create pipe for stdout");
+    if (make_cloexec_pipe(perr)) throw std::runtime_error("Cannot create pipe for stderr");
     auto child_pid = fork();
     if (child_pid == -1) throw std::runtime_error("Failed to fork child process, damn it! ");
     if (child_pid == 0) {
@@ -272,103 +996,1210 @@ inline CommandOutput execute_command(const std::vector<std::string>& argv, bool
         close(pout[0]); close(pout[1]);
         close(perr[0]); close(perr[1]);
 
-        // Doing dirty C stuffs
-        // A little memory leak here should be ok.
-        char **c_argv = new char*[argv.size()+1];
-        for (int i = 0; i < argv.size(); i++) {
-            c_argv[i] = new char[argv[i].size()+1];
-            std::strcpy(c_argv[i], argv[i].data());
-        }
-        c_argv[argv.size()] = 0;
-        int res = execvp(c_argv[0], c_argv);
-        if (res == -1) {
-            std::cerr << "Failed to spawn child process" << std::endl;
-            exit(1);
+        if (own_group) setpgid(0, 0);
+        if (!options.cwd.empty() && chdir(options.cwd.c_str()) != 0) {
+            const char msg[] = "Failed to change working directory of child process\n";
+            write(STDERR_FILENO, msg, sizeof(msg) - 1);
+            _exit(1);
         }
-        throw std::logic_error("unreachable!");
+        if (!c_env.empty()) environ = c_env.data();
+        execvp(c_argv[0], c_argv.data());
+        const char msg[] = "Failed to spawn child process\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        _exit(1);
     } else {
+        // Also done by the parent, so the group exists before it might be killed.
+        if (own_group) setpgid(child_pid, child_pid);
+        g_running_commands.add(child_pid, own_group);
         close(pout[1]);
         close(perr[1]);
-        char buf[1024];
-        std::size_t size;
         CommandOutput result;
+        auto deadline = std::chrono::steady_clock::now() + options.timeout;
+        // Milliseconds left before the deadline, -1 without a timeout. Kills the child once it passed.
+        auto time_left = [&]() -> int {
+            if (!options.timeout.count() || result.timed_out) return -1;
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (left > 0) return static_cast<int>(left);
+            kill(-child_pid, SIGKILL);
+            result.timed_out = true;
+            return -1;
+        };
         if (redirect_output) {
-            while ((size = read(pout[0], buf, 1024)) != 0) {
-                for (std::size_t idx = 0; idx < size; idx++) {
-                    result.stdout_content.push_back(buf[idx]);
+            // Drain both pipes at the same time, so a child filling one of them never blocks.
+            char buf[4096];
+            std::size_t line_start = 0;
+            struct pollfd fds[2] = { { pout[0], POLLIN, 0 }, { perr[0], POLLIN, 0 } };
+            int open_fds = 2;
+            while (open_fds) {
+                if (poll(fds, 2, time_left()) == -1) {
+                    if (errno == EINTR) continue;
+                    break;
                 }
-            }
-            while ((size = read(perr[0], buf, 1024)) != 0) {
-                for (std::size_t idx = 0; idx < size; idx++) {
-                    result.stderr_content.push_back(buf[idx]);
+                for (int k = 0; k < 2; k++) {
+                    if (fds[k].fd < 0 || !(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                    auto size = read(fds[k].fd, buf, sizeof(buf));
+                    if (size <= 0) {
+                        if (size == -1 && errno == EINTR) continue;
+                        fds[k].fd = -1;
+                        open_fds--;
+                        continue;
+                    }
+                    if (k == 0) {
+                        result.stdout_content.append(buf, size);
+                        continue;
+                    }
+                    result.stderr_content.append(buf, size);
+                    if (on_stderr_line) {
+                        std::size_t newline;
+                        while ((newline = result.stderr_content.find('\n', line_start)) != std::string::npos) {
+                            on_stderr_line(std::string_view(result.stderr_content).substr(line_start, newline + 1 - line_start));
+                            line_start = newline + 1;
+                        }
+                    }
                 }
             }
+            if (on_stderr_line && line_start < result.stderr_content.size()) {
+                on_stderr_line(std::string_view(result.stderr_content).substr(line_start));
+            }
         } else {
             result.stdout_content = "<invalid>";
             result.stderr_content = "<invalid>";
         }
-        waitpid(child_pid, &result.ret_code, 0);
+        close(pout[0]);
+        close(perr[0]);
+
+        struct rusage usage {};
+        if (options.timeout.count()) {
+            while (true) {
+                auto pid = wait4(child_pid, &result.ret_code, WNOHANG, &usage);
+                if (pid == child_pid || (pid == -1 && errno != EINTR)) break;
+                time_left();
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        } else {
+            while (wait4(child_pid, &result.ret_code, 0, &usage) == -1 && errno == EINTR) {}
+        }
+        g_running_commands.remove(child_pid);
+#ifdef __MACH__
+        result.peak_memory = usage.ru_maxrss;
+#else
+        result.peak_memory = static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+        auto microseconds = [](const struct timeval& tv) {
+            return static_cast<std::uint64_t>(tv.tv_sec) * 1000000 + static_cast<std::uint64_t>(tv.tv_usec);
+        };
+        result.usage.commands = 1;
+        result.usage.user_time = microseconds(usage.ru_utime);
+        result.usage.sys_time = microseconds(usage.ru_stime);
+        result.usage.peak_memory = result.peak_memory;
+        result.usage.minor_faults = usage.ru_minflt;
+        result.usage.major_faults = usage.ru_majflt;
+        result.usage.voluntary_switches = usage.ru_nvcsw;
+        result.usage.involuntary_switches = usage.ru_nivcsw;
+        if (g_job_usage) g_job_usage->add(result.usage);
         return result;
     }
 }
 
 // }}}
 
-// {{{Raw compilation thingy
+// {{{ Diagnostics
 
-// Generates argv from a compilation call. Defaults to C and if `is_cxx` was set to `true` then C++.
-inline std::vector<std::string> generate_compilation_argv(bool is_cxx, std::string_view src, std::string_view dest, const std::vector<std::string>& args, bool link_executable) {
-    std::vector<std::string> compiler_args;
-    compiler_args.push_back(is_cxx ? get_cxx() : get_cc());
+// How diagnostics (stderr) of compilers and linkers are shown.
+enum class DiagnosticsMode {
+    // Print every line as soon as it arrives.
+    Live,
+    // Print them once the job finishes, including warnings of successful jobs.
+    AfterJob,
+    // Only print them when the job fails.
+    OnFailure,
+};
 
-    if (!link_executable) {
-        compiler_args.push_back("-c");
-    }
-    compiler_args.push_back("-o");
-    compiler_args.push_back(std::string(dest));
+inline DiagnosticsMode g_diagnostics_mode = DiagnosticsMode::Live;
 
-    for (const auto& arg : args) {
-        compiler_args.push_back(arg);
-    }
+// Whether to pass `-fdiagnostics-color=always` to compilers and linkers. Unset means only when stderr is a terminal.
+inline std::optional<bool> g_diagnostics_color;
 
-    for (const auto& arg : get_env_flags(is_cxx ? "CXXFLAGS" : "CFLAGS")) {
-        compiler_args.push_back(arg);
-    }
+// Writes diagnostics of concurrent jobs to stderr through `g_logger`. Output is written in whole lines, and a header
+// naming the job is written whenever output switches to another job, so lines never interleave.
+class DiagnosticsPrinter {
+    std::mutex m_mutex;
+    std::string m_last_job;
 
-    if (link_executable) {
-        for (const auto& arg : get_env_flags("LDFLAGS")) {
-            compiler_args.push_back(arg);
+    public:
+    // Print `text` (one or more lines) produced by job `job`.
+    void print(std::string_view job, std::string_view text) {
+        if (text.empty()) return;
+        std::string output;
+        std::lock_guard lock(m_mutex);
+        if (m_last_job != job) {
+            output += "[DIAGNOSTICS] ";
+            output += job;
+            output += '\n';
+            m_last_job = job;
         }
+        output += text;
+        if (!text.ends_with('\n')) output += '\n';
+        g_logger.write(std::move(output));
     }
+};
 
-    compiler_args.push_back(std::string(src));
-    return compiler_args;
-}
+inline DiagnosticsPrinter g_diagnostics_printer;
 
-// Compile C source file `src` into artifact `dest`.
-// Optional arguments includes `args` to pass extra flags to the compiler and `link_executable` that denotes whether the artifact is an executable.
-inline void compile_c_source(std::string_view src, std::string_view dest, const std::vector<std::string>& args = {}, bool link_executable = true) {
-    auto result = execute_command(generate_compilation_argv(false, src, dest, args, link_executable));
-    if (result.ret_code != 0) {
-        log("ERROR", "Compilation failed with: \n{}", result.stderr_content);
-        throw std::runtime_error("Compilation failed");
-    }
+inline bool diagnostics_color_enabled() {
+    static const bool is_tty = isatty(STDERR_FILENO);
+    return g_diagnostics_color.value_or(is_tty);
 }
 
-// Compile C++ source file `src` into artifact `dest`.
-// Optional arguments includes `args` to pass extra flags to the compiler and `link_executable` that denotes whether the artifact is an executable.
-inline void compile_cxx_source(std::string_view src, std::string_view dest, const std::vector<std::string>& args = {}, bool link_executable = true) {
+// Run a compiler or linker named `job`, showing its diagnostics according to `g_diagnostics_mode`.
+// Coloured diagnostics are requested when `supports_color` is set and colour is enabled.
+inline CommandOutput execute_tool(std::vector<std::string> argv, std::string_view job, bool supports_color = true) {
+    if (supports_color && diagnostics_color_enabled() && !argv.empty()) {
+        argv.insert(argv.begin() + 1, "-fdiagnostics-color=always");
+    }
 
-    auto result = execute_command(generate_compilation_argv(true, src, dest, args, link_executable));
-    if (result.ret_code != 0) {
-        log("ERROR", "Compilation failed with: \n{}", result.stderr_content);
-        throw std::runtime_error("Compilation failed");
+    CommandOutput result;
+    if (g_diagnostics_mode == DiagnosticsMode::Live) {
+        result = execute_command(argv, true, [job](std::string_view line) {
+            g_diagnostics_printer.print(job, line);
+        });
+    } else {
+        result = execute_command(argv);
+        if (g_diagnostics_mode == DiagnosticsMode::AfterJob || result.ret_code != 0) {
+            g_diagnostics_printer.print(job, result.stderr_content);
+        }
+    }
+    if (!result.stdout_content.empty()) {
+        g_diagnostics_printer.print(job, result.stdout_content);
     }
+    return result;
 }
 
 // }}}
 
-// {{{Raw linking thingy
+// {{{ Build log
+
+// Facts about an output learnt from previous runs.
+struct BuildRecord {
+    // Peak resident set size of the command producing the output, in bytes.
+    std::uint64_t peak_memory = 0;
+    // Wall time of the command producing the output, in milliseconds.
+    std::uint64_t duration = 0;
+    // Content hash of the output, valid while its modification time is `hash_mtime`.
+    std::uint64_t hash = 0;
+    std::int64_t hash_mtime = 0;
+    // Hash of the inputs the output was last produced from.
+    std::uint64_t input_hash = 0;
+    // Modification time of the newest input known to be reflected in the output, which may be newer
+    // than the output itself when producing it was skipped because inputs didn't really change.
+    std::int64_t input_mtime = 0;
+    // CPU time of the command producing the output in user and kernel mode, in microseconds.
+    std::uint64_t user_time = 0;
+    std::uint64_t sys_time = 0;
+    std::uint64_t minor_faults = 0;
+    std::uint64_t major_faults = 0;
+    std::uint64_t voluntary_switches = 0;
+    std::uint64_t involuntary_switches = 0;
+
+    // Record resources used to produce the output, taking `duration` milliseconds.
+    void set_usage(const ResourceUsage& usage, std::uint64_t duration_ms) {
+        duration = duration_ms;
+        peak_memory = usage.peak_memory;
+        user_time = usage.user_time;
+        sys_time = usage.sys_time;
+        minor_faults = usage.minor_faults;
+        major_faults = usage.major_faults;
+        voluntary_switches = usage.voluntary_switches;
+        involuntary_switches = usage.involuntary_switches;
+    }
+};
+
+// Per build directory log of records keyed by output path, persisted across runs.
+// Every line looks like `<output>\t<key>=<value>\t<key>=<value>...`, unknown keys are ignored.
+// Header dependencies read from depfiles are kept next to it in `.oinbs_deps`, where every path
+// is written once as `p <path>` and outputs refer to them by index as `o <output>\t<index>...`,
+// so loading dependencies of a large target is a single read.
+class BuildLog {
+    std::filesystem::path m_path;
+    std::unordered_map<std::string, BuildRecord> m_records;
+    std::vector<std::string> m_dep_paths;
+    std::unordered_map<std::string, std::uint32_t> m_dep_ids;
+    std::unordered_map<std::string, std::vector<std::uint32_t>> m_deps;
+    bool m_dirty = false;
+    bool m_deps_dirty = false;
+    std::mutex m_mutex;
+
+    std::filesystem::path m_deps_path() const {
+        return m_path.parent_path() / ".oinbs_deps";
+    }
+
+    std::uint32_t m_dep_id(const std::string& path) {
+        auto [it, inserted] = m_dep_ids.try_emplace(path, static_cast<std::uint32_t>(m_dep_paths.size()));
+        if (inserted) m_dep_paths.push_back(path);
+        return it->second;
+    }
+
+    void m_load_deps() {
+        std::ifstream ifs(m_deps_path());
+        std::string line;
+        while (std::getline(ifs, line)) {
+            if (line.starts_with("p ")) {
+                m_dep_id(line.substr(2));
+            } else if (line.starts_with("o ")) {
+                std::string_view rest = std::string_view(line).substr(2);
+                auto tab = rest.find('\t');
+                auto& deps = m_deps[std::string(rest.substr(0, tab))];
+                while (tab != std::string_view::npos) {
+                    rest = rest.substr(tab + 1);
+                    tab = rest.find('\t');
+                    auto id = std::strtoul(std::string(rest.substr(0, tab)).c_str(), nullptr, 10);
+                    if (id < m_dep_paths.size()) deps.push_back(static_cast<std::uint32_t>(id));
+                }
+            }
+        }
+    }
+
+    void m_parse_field(BuildRecord& record, std::string_view key, std::string_view value) {
+        auto number = std::strtoull(std::string(value).c_str(), nullptr, 10);
+        if (key == "peak_memory") {
+            record.peak_memory = number;
+        } else if (key == "duration") {
+            record.duration = number;
+        } else if (key == "hash") {
+            record.hash = number;
+        } else if (key == "hash_mtime") {
+            record.hash_mtime = static_cast<std::int64_t>(number);
+        } else if (key == "input_hash") {
+            record.input_hash = number;
+        } else if (key == "input_mtime") {
+            record.input_mtime = static_cast<std::int64_t>(number);
+        } else if (key == "user_time") {
+            record.user_time = number;
+        } else if (key == "sys_time") {
+            record.sys_time = number;
+        } else if (key == "minor_faults") {
+            record.minor_faults = number;
+        } else if (key == "major_faults") {
+            record.major_faults = number;
+        } else if (key == "voluntary_switches") {
+            record.voluntary_switches = number;
+        } else if (key == "involuntary_switches") {
+            record.involuntary_switches = number;
+        }
+    }
+
+    public:
+    explicit BuildLog(std::filesystem::path path) : m_path(std::move(path)) {
+        std::ifstream ifs(m_path);
+        std::string line;
+        while (std::getline(ifs, line)) {
+            std::string_view rest = line;
+            auto tab = rest.find('\t');
+            BuildRecord record;
+            std::string key(rest.substr(0, tab));
+            while (tab != std::string_view::npos) {
+                rest = rest.substr(tab + 1);
+                tab = rest.find('\t');
+                auto field = rest.substr(0, tab);
+                auto eq = field.find('=');
+                if (eq != std::string_view::npos) {
+                    m_parse_field(record, field.substr(0, eq), field.substr(eq + 1));
+                }
+            }
+            m_records[key] = record;
+        }
+        m_load_deps();
+    }
+
+    // Whether dependencies of `output` have been recorded.
+    bool has_deps(const std::string& output) {
+        std::lock_guard lock(m_mutex);
+        return m_deps.contains(output);
+    }
+
+    // Call `fn` with every recorded dependency of `output` until it returns false.
+    // Returns false if any call returned false.
+    template <typename Fn>
+    bool all_deps(const std::string& output, Fn&& fn) requires std::is_invocable_r_v<bool, Fn, const std::string&> {
+        std::lock_guard lock(m_mutex);
+        auto it = m_deps.find(output);
+        if (it == m_deps.end()) return true;
+        for (auto id : it->second) {
+            if (!fn(m_dep_paths[id])) return false;
+        }
+        return true;
+    }
+
+    // Replace dependencies of `output`.
+    void set_deps(const std::string& output, const std::vector<std::string>& deps) {
+        std::lock_guard lock(m_mutex);
+        auto& ids = m_deps[output];
+        ids.clear();
+        for (const auto& dep : deps) {
+            ids.push_back(m_dep_id(dep));
+        }
+        m_deps_dirty = true;
+    }
+
+    // Forget everything recorded about `output`.
+    void forget(const std::string& output) {
+        std::lock_guard lock(m_mutex);
+        m_dirty |= m_records.erase(output) > 0;
+        m_deps_dirty |= m_deps.erase(output) > 0;
+    }
+
+    // Get record of `output`, if there's any.
+    std::optional<BuildRecord> get(const std::string& output) {
+        std::lock_guard lock(m_mutex);
+        auto it = m_records.find(output);
+        if (it == m_records.end()) return std::nullopt;
+        return it->second;
+    }
+
+    // Modify record of `output` with `fn`, creating it if needed.
+    template <typename Fn>
+    void update(const std::string& output, Fn&& fn) requires std::is_invocable_v<Fn, BuildRecord&> {
+        std::lock_guard lock(m_mutex);
+        fn(m_records[output]);
+        m_dirty = true;
+    }
+
+    // Content hash of file `path`, only read again when its modification time changed since last time.
+    std::uint64_t file_hash(const std::string& path) {
+        auto mtime = g_stat_cache.get(path).mtime;
+        if (auto record = get(path); record && record->hash_mtime == mtime) {
+            return record->hash;
+        }
+        auto hash = hash_file(path);
+        update(path, [&](BuildRecord& record) {
+            record.hash = hash;
+            record.hash_mtime = mtime;
+        });
+        return hash;
+    }
+
+    // Write the log back to disk if anything changed.
+    void save() {
+        std::lock_guard lock(m_mutex);
+        if (m_path.has_parent_path() && !g_stat_cache.exists(m_path.parent_path())) return;
+
+        if (m_dirty) {
+            m_dirty = false;
+            std::ofstream ofs(m_path);
+            for (const auto& [output, record] : m_records) {
+                ofs << output;
+                ofs << "\tpeak_memory=" << record.peak_memory;
+                ofs << "\tduration=" << record.duration;
+                if (record.hash_mtime) {
+                    ofs << "\thash=" << record.hash << "\thash_mtime=" << record.hash_mtime;
+                }
+                if (record.input_mtime || record.input_hash) {
+                    ofs << "\tinput_hash=" << record.input_hash << "\tinput_mtime=" << record.input_mtime;
+                }
+                if (record.user_time || record.sys_time) {
+                    ofs << "\tuser_time=" << record.user_time << "\tsys_time=" << record.sys_time;
+                    ofs << "\tminor_faults=" << record.minor_faults << "\tmajor_faults=" << record.major_faults;
+                    ofs << "\tvoluntary_switches=" << record.voluntary_switches << "\tinvoluntary_switches=" << record.involuntary_switches;
+                }
+                ofs << '\n';
+            }
+        }
+
+        if (m_deps_dirty) {
+            m_deps_dirty = false;
+            // Only paths still referenced are written, renumbered in order of appearance.
+            std::vector<std::int64_t> remap(m_dep_paths.size(), -1);
+            std::int64_t next_id = 0;
+            std::ofstream deps(m_deps_path());
+            for (const auto& [output, ids] : m_deps) {
+                for (auto id : ids) {
+                    if (remap[id] < 0) {
+                        remap[id] = next_id++;
+                        deps << "p " << m_dep_paths[id] << '\n';
+                    }
+                }
+            }
+            for (const auto& [output, ids] : m_deps) {
+                deps << "o " << output;
+                for (auto id : ids) {
+                    deps << '\t' << remap[id];
+                }
+                deps << '\n';
+            }
+        }
+    }
+};
+
+// Get the build log living in directory `dir`. Logs are loaded once and shared by the whole process.
+inline BuildLog& get_build_log(const std::filesystem::path& dir) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<BuildLog>> logs;
+    std::lock_guard lock(mutex);
+    auto& log = logs[dir.lexically_normal().string()];
+    if (!log) {
+        log = std::make_unique<BuildLog>(dir / ".oinbs_log");
+    }
+    return *log;
+}
+
+// }}}
+
+// {{{ Job scheduling
+
+// A unit of work for the scheduler.
+struct Job {
+    std::string name;
+    std::function<void()> action;
+    // Estimated peak memory usage in bytes. 0 means unknown.
+    std::uint64_t memory_weight = 0;
+    // Predicted duration in milliseconds, usually taken from the build log. 0 means unknown.
+    std::uint64_t predicted_duration = 0;
+    // Indices of jobs that must finish before this one starts.
+    std::vector<std::size_t> deps;
+    // Name of the `JobPool` limiting this job, empty for none.
+    std::string pool;
+};
+
+// Summary of a `run_jobs` call.
+struct BuildSummary {
+    std::size_t jobs = 0;
+    std::uint64_t wall_time = 0;
+    // Longest chain of dependent jobs by predicted and by actual durations, in milliseconds.
+    std::uint64_t predicted_critical_path = 0;
+    std::uint64_t actual_critical_path = 0;
+    // Jobs on the actual critical path, in the order they ran.
+    std::vector<std::string> critical_jobs;
+    // Resources used by commands of every job, and their sum.
+    struct JobUsage {
+        std::string name;
+        std::uint64_t wall_time = 0;
+        ResourceUsage usage;
+    };
+    std::vector<JobUsage> job_usage;
+    ResourceUsage total_usage;
+
+    // Jobs that ran commands, ordered by `key` from the largest, at most `limit` of them.
+    template <typename Key>
+    std::vector<const JobUsage*> top_jobs(Key&& key, std::size_t limit) const {
+        std::vector<const JobUsage*> result;
+        for (const auto& job : job_usage) {
+            if (job.usage.commands) result.push_back(&job);
+        }
+        std::sort(result.begin(), result.end(), [&](const JobUsage* a, const JobUsage* b) { return key(*a) > key(*b); });
+        if (result.size() > limit) result.resize(limit);
+        return result;
+    }
+
+    void print() const {
+        log("INFO", "Finished {} jobs in {} ms, critical path predicted {} ms, actual {} ms", jobs, wall_time, predicted_critical_path, actual_critical_path);
+        if (!critical_jobs.empty()) {
+            std::string chain = critical_jobs[0];
+            for (std::size_t i = 1; i < critical_jobs.size(); i++) {
+                chain += " -> " + critical_jobs[i];
+            }
+            log("INFO", "Critical path: {}", chain);
+        }
+        if (!total_usage.commands) return;
+
+        const auto& total = total_usage;
+        log("INFO", "{} commands used {} ms user and {} ms sys CPU time, peak RSS {} MiB, {} major and {} minor page faults, {} voluntary and {} involuntary context switches",
+            total.commands, total.user_time / 1000, total.sys_time / 1000, total.peak_memory >> 20, total.major_faults, total.minor_faults, total.voluntary_switches, total.involuntary_switches);
+        if (total.commands < 2) return;
+        for (auto job : top_jobs([](const JobUsage& job) { return job.usage.user_time + job.usage.sys_time; }, 5)) {
+            log("INFO", "Top CPU: {} ms CPU, {} ms wall, {} MiB peak RSS: {}", (job->usage.user_time + job->usage.sys_time) / 1000, job->wall_time, job->usage.peak_memory >> 20, job->name);
+        }
+        for (auto job : top_jobs([](const JobUsage& job) { return job.usage.peak_memory; }, 3)) {
+            log("INFO", "Top memory: {} MiB peak RSS, {} major page faults: {}", job->usage.peak_memory >> 20, job->usage.major_faults, job->name);
+        }
+    }
+};
+
+// Snapshot of how busy the machine is.
+struct SystemLoad {
+    // One minute load average, negative if unavailable.
+    double load_average = -1;
+    // Memory that could be used by new jobs in bytes, taking cgroup v2 limits into account.
+    std::optional<std::uint64_t> memory_available;
+    // `some avg10` of cgroup v2 `memory.pressure` (or `/proc/pressure/memory`), negative if unavailable.
+    double memory_pressure = -1;
+};
+
+// Read a number from the first line of a file, `max` is treated as no value.
+inline std::optional<std::uint64_t> read_number_file(const std::filesystem::path& path) {
+    std::ifstream ifs(path);
+    std::string value;
+    if (!(ifs >> value) || value == "max") return std::nullopt;
+    return std::strtoull(value.c_str(), nullptr, 10);
+}
+
+// Find the cgroup v2 directory of current process. Returns empty path if there's none.
+inline std::filesystem::path cgroup_v2_dir() {
+    std::ifstream ifs("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.starts_with("0::")) {
+            auto dir = std::filesystem::path("/sys/fs/cgroup") / std::filesystem::path(line.substr(3)).relative_path();
+            if (std::filesystem::exists(dir / "memory.max")) return dir;
+            if (std::filesystem::exists("/sys/fs/cgroup/memory.max")) return "/sys/fs/cgroup";
+        }
+    }
+    return {};
+}
+
+// Read current load of the system. Anything that isn't available is left unset.
+inline SystemLoad read_system_load() {
+    SystemLoad result;
+
+    std::ifstream loadavg("/proc/loadavg");
+    if (!(loadavg >> result.load_average)) {
+        double avg[1];
+        result.load_average = getloadavg(avg, 1) == 1 ? avg[0] : -1;
+    }
+
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    std::uint64_t value;
+    std::string unit;
+    while (meminfo >> key >> value >> unit) {
+        if (key == "MemAvailable:") {
+            result.memory_available = value * 1024;
+            break;
+        }
+    }
+
+    static const auto cgroup = cgroup_v2_dir();
+    auto pressure_file = std::filesystem::path("/proc/pressure/memory");
+    if (!cgroup.empty()) {
+        auto limit = read_number_file(cgroup / "memory.max");
+        auto current = read_number_file(cgroup / "memory.current");
+        if (limit && current) {
+            // Inactive page cache could be reclaimed without hurting anyone.
+            std::uint64_t reclaimable = 0;
+            std::ifstream stat(cgroup / "memory.stat");
+            while (stat >> key >> value) {
+                if (key == "inactive_file") {
+                    reclaimable = value;
+                    break;
+                }
+            }
+            auto used = *current > reclaimable ? *current - reclaimable : 0;
+            auto cgroup_available = *limit > used ? *limit - used : 0;
+            if (!result.memory_available || cgroup_available < *result.memory_available) {
+                result.memory_available = cgroup_available;
+            }
+        }
+        pressure_file = cgroup / "memory.pressure";
+    }
+
+    std::ifstream pressure(pressure_file);
+    std::string field;
+    while (pressure >> field) {
+        if (field.starts_with("avg10=")) {
+            result.memory_pressure = std::strtod(field.c_str() + 6, nullptr);
+            break;
+        }
+    }
+
+    return result;
+}
+
+// Limits how many jobs of one kind run at once, independently of the overall job count, like ninja's `pool`.
+class JobPool {
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::size_t m_depth;
+    std::size_t m_running = 0;
+
+    public:
+    // `depth` of 0 means unlimited.
+    explicit JobPool(std::size_t depth = 0) : m_depth(depth) {}
+
+    void set_depth(std::size_t depth) {
+        std::lock_guard lock(m_mutex);
+        m_depth = depth;
+        m_cv.notify_all();
+    }
+
+    std::size_t depth() {
+        std::lock_guard lock(m_mutex);
+        return m_depth;
+    }
+
+    // Take a slot if one is free.
+    bool try_acquire() {
+        std::lock_guard lock(m_mutex);
+        if (m_depth && m_running >= m_depth) return false;
+        m_running++;
+        return true;
+    }
+
+    // Take a slot, waiting for one to be free.
+    void acquire() {
+        std::unique_lock lock(m_mutex);
+        m_cv.wait(lock, [&] { return !m_depth || m_running < m_depth; });
+        m_running++;
+    }
+
+    void release() {
+        std::lock_guard lock(m_mutex);
+        m_running--;
+        m_cv.notify_one();
+    }
+};
+
+// Get pool `name`, created on first use. Depths are read from `OINBS_POOLS` formatted as `<name>=<depth>,...`,
+// other pools are unlimited until `set_pool_depth` is called.
+// Targets put linking into pool `link`, `invoke_build_script` uses pool `build_script`.
+inline JobPool& get_job_pool(const std::string& name) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<JobPool>> pools;
+    std::lock_guard lock(mutex);
+    auto& pool = pools[name];
+    if (!pool) {
+        std::size_t depth = 0;
+        if (auto env = std::getenv("OINBS_POOLS")) {
+            std::string_view rest = env;
+            while (!rest.empty()) {
+                auto entry = rest.substr(0, rest.find(','));
+                rest = entry.size() < rest.size() ? rest.substr(entry.size() + 1) : std::string_view {};
+                auto eq = entry.find('=');
+                if (eq != std::string_view::npos && entry.substr(0, eq) == name) {
+                    depth = std::strtoul(std::string(entry.substr(eq + 1)).c_str(), nullptr, 10);
+                }
+            }
+        }
+        pool = std::make_unique<JobPool>(depth);
+    }
+    return *pool;
+}
+
+// Run at most `depth` jobs of pool `name` at once, 0 means unlimited.
+inline void set_pool_depth(const std::string& name, std::size_t depth) {
+    get_job_pool(name).set_depth(depth);
+}
+
+// Holds a slot of a pool for its lifetime.
+class PoolSlot {
+    JobPool& m_pool;
+
+    public:
+    explicit PoolSlot(const std::string& name) : m_pool(get_job_pool(name)) {
+        m_pool.acquire();
+    }
+    ~PoolSlot() {
+        m_pool.release();
+    }
+    PoolSlot(const PoolSlot&) = delete;
+    PoolSlot& operator=(const PoolSlot&) = delete;
+};
+
+// Slots shared by every scheduler of the process, `get_max_jobs()` of them: jobs of `run_jobs` and blocking work of
+// steps take one each, so a target built from a step or a step run from a job stays within `-j` together with them.
+inline JobPool& get_job_slots() {
+    static JobPool slots;
+    if (slots.depth() != get_max_jobs()) slots.set_depth(get_max_jobs());
+    return slots;
+}
+
+// Whether the current thread holds a slot of `get_job_slots()`.
+inline thread_local bool g_holds_job_slot = false;
+
+// Holds a slot of `get_job_slots()` for its lifetime, unless the current thread already holds one.
+class JobSlot {
+    bool m_acquired = false;
+
+    public:
+    JobSlot() {
+        if (g_holds_job_slot) return;
+        get_job_slots().acquire();
+        g_holds_job_slot = m_acquired = true;
+    }
+    ~JobSlot() {
+        if (!m_acquired) return;
+        g_holds_job_slot = false;
+        get_job_slots().release();
+    }
+    JobSlot(const JobSlot&) = delete;
+    JobSlot& operator=(const JobSlot&) = delete;
+};
+
+// Gives the slot of the current thread back while it waits for nested work, like make's jobserver, taking it again
+// afterwards. Nested work could use every slot then, and waiting threads never starve it.
+class LentJobSlot {
+    bool m_lent;
+
+    public:
+    LentJobSlot() : m_lent(g_holds_job_slot) {
+        if (!m_lent) return;
+        g_holds_job_slot = false;
+        get_job_slots().release();
+    }
+    ~LentJobSlot() {
+        if (!m_lent) return;
+        get_job_slots().acquire();
+        g_holds_job_slot = true;
+    }
+    LentJobSlot(const LentJobSlot&) = delete;
+    LentJobSlot& operator=(const LentJobSlot&) = delete;
+};
+
+// Policy deciding whether another job could be started, based on load average and memory.
+// A job is always allowed to start when nothing else is running, so builds never stall.
+struct ThrottlePolicy {
+    // Whether to throttle at all. When disabled only `get_max_jobs()` limits concurrency.
+    bool enabled = true;
+    // Don't start jobs while load average is above this. 0 means number of hardware threads.
+    double max_load_average = 0;
+    // Memory kept free for the rest of the system in bytes.
+    std::uint64_t memory_reserve = 512ull << 20;
+    // Assumed peak memory of jobs without known memory weight in bytes.
+    std::uint64_t default_memory_weight = 512ull << 20;
+    // Don't start jobs while memory pressure (`some avg10`, in percent) is above this. Negative disables the check.
+    double max_memory_pressure = 20.0;
+    // How often system load is sampled.
+    std::chrono::milliseconds sample_interval { 200 };
+};
+
+inline ThrottlePolicy g_throttle_policy;
+
+// Keeps track of memory promised to running jobs and decides admissions by `g_throttle_policy`.
+class Throttle {
+    ThrottlePolicy m_policy;
+    SystemLoad m_load;
+    std::chrono::steady_clock::time_point m_sampled_at;
+    // Memory available when the first job started, running jobs are charged against it.
+    std::optional<std::uint64_t> m_budget;
+    std::uint64_t m_charged = 0;
+
+    void m_sample() {
+        auto now = std::chrono::steady_clock::now();
+        if (m_sampled_at.time_since_epoch().count() && now - m_sampled_at < m_policy.sample_interval) return;
+        m_load = read_system_load();
+        m_sampled_at = now;
+    }
+
+    public:
+    Throttle() : m_policy(g_throttle_policy) {}
+
+    std::uint64_t weight_of(const Job& job) const {
+        return job.memory_weight ? job.memory_weight : m_policy.default_memory_weight;
+    }
+
+    // Whether `job` could be started with `running` jobs in flight.
+    bool admit(const Job& job, std::size_t running) {
+        if (!m_policy.enabled || running == 0) return true;
+        m_sample();
+
+        auto max_load = m_policy.max_load_average > 0 ? m_policy.max_load_average : static_cast<double>(std::thread::hardware_concurrency());
+        if (max_load > 0 && m_load.load_average > max_load) return false;
+
+        if (m_policy.max_memory_pressure >= 0 && m_load.memory_pressure > m_policy.max_memory_pressure) return false;
+
+        if (m_budget) {
+            auto weight = weight_of(job);
+            if (m_charged + weight + m_policy.memory_reserve > *m_budget) return false;
+        }
+        if (m_load.memory_available && *m_load.memory_available < m_policy.memory_reserve) return false;
+        return true;
+    }
+
+    // Charge memory of a started job.
+    void start(const Job& job) {
+        if (!m_budget) {
+            m_sample();
+            m_budget = m_load.memory_available;
+        }
+        m_charged += weight_of(job);
+    }
+
+    // Give back memory of a finished job.
+    void finish(const Job& job) {
+        auto weight = weight_of(job);
+        m_charged = m_charged > weight ? m_charged - weight : 0;
+    }
+};
+
+// Milliseconds elapsed since `since`.
+inline std::uint64_t elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Last SIGINT or SIGTERM caught by `InterruptGuard`, 0 if none.
+inline std::atomic<int> g_interrupt_signal { 0 };
+
+// Catches SIGINT and SIGTERM into `g_interrupt_signal` while alive, so running children can be cancelled and reaped
+// instead of being orphaned. Guards of concurrent `run_jobs` calls share the handler: the first one installs it and
+// clears the signal, the last one restores previous handlers, whatever order they're destroyed in.
+class InterruptGuard {
+    static inline std::mutex m_mutex;
+    static inline struct sigaction m_old_int {};
+    static inline struct sigaction m_old_term {};
+
+    static void m_handler(int sig) {
+        g_interrupt_signal.store(sig);
+    }
+
+    public:
+    InterruptGuard() {
+        std::lock_guard lock(m_mutex);
+        if (g_interrupt_guards.load() == 0) {
+            g_interrupt_signal.store(0);
+            struct sigaction action {};
+            action.sa_handler = m_handler;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGINT, &action, &m_old_int);
+            sigaction(SIGTERM, &action, &m_old_term);
+        }
+        g_interrupt_guards++;
+    }
+
+    ~InterruptGuard() {
+        std::lock_guard lock(m_mutex);
+        if (--g_interrupt_guards == 0) {
+            sigaction(SIGINT, &m_old_int, nullptr);
+            sigaction(SIGTERM, &m_old_term, nullptr);
+        }
+    }
+
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+};
+
+// Run `jobs` concurrently respecting their `deps`, limited by `max_jobs` (`get_max_jobs()` if 0) and `g_throttle_policy`.
+// Ready jobs start in order of their predicted critical path, so long chains and long jobs aren't left for last.
+// Failures are handled according to `get_keep_going()`: fail-fast cancels running jobs on the first failure and rethrows
+// it, keep-going starts jobs not depending on failed ones until the limit is reached and reports every failure at the end.
+// SIGINT and SIGTERM cancel running jobs as well.
+// Unless `max_jobs` is given, every running job holds a slot of `get_job_slots()`, and a caller holding one lends it to
+// the jobs meanwhile.
+inline BuildSummary run_jobs(std::vector<Job>& jobs, std::size_t max_jobs = 0) {
+    BuildSummary summary;
+    summary.jobs = jobs.size();
+    if (jobs.empty()) return summary;
+    bool use_slots = !max_jobs;
+    LentJobSlot lent_slot;
+
+    auto n = jobs.size();
+    std::vector<std::vector<std::size_t>> dependents(n);
+    std::vector<std::size_t> pending_deps(n);
+    for (std::size_t i = 0; i < n; i++) {
+        for (auto dep : jobs[i].deps) {
+            if (dep >= n) throw std::logic_error(std::format("Job {} depends on non-existing job {}", jobs[i].name, dep));
+            dependents[dep].push_back(i);
+        }
+        pending_deps[i] = jobs[i].deps.size();
+    }
+
+    // Topological order, used to compute critical paths.
+    std::vector<std::size_t> order;
+    {
+        auto remaining = pending_deps;
+        for (std::size_t i = 0; i < n; i++) {
+            if (!remaining[i]) order.push_back(i);
+        }
+        for (std::size_t k = 0; k < order.size(); k++) {
+            for (auto next : dependents[order[k]]) {
+                if (!--remaining[next]) order.push_back(next);
+            }
+        }
+        if (order.size() != n) throw std::logic_error("Dependency cycle between jobs");
+    }
+
+    // Jobs never seen before are assumed to take as long as the average known job.
+    std::uint64_t known_total = 0, known_count = 0;
+    for (const auto& job : jobs) {
+        if (job.predicted_duration) {
+            known_total += job.predicted_duration;
+            known_count++;
+        }
+    }
+    auto default_duration = known_count ? known_total / known_count : 0;
+
+    // Priority of a job is the predicted length of the longest chain starting from it.
+    std::vector<std::uint64_t> priority(n);
+    for (auto it = order.rbegin(); it != order.rend(); it++) {
+        std::uint64_t tail = 0;
+        for (auto next : dependents[*it]) {
+            tail = std::max(tail, priority[next]);
+        }
+        priority[*it] = (jobs[*it].predicted_duration ? jobs[*it].predicted_duration : default_duration) + tail;
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (jobs[i].deps.empty()) summary.predicted_critical_path = std::max(summary.predicted_critical_path, priority[i]);
+    }
+
+    auto by_priority = [&](std::size_t a, std::size_t b) {
+        if (priority[a] != priority[b]) return priority[a] < priority[b];
+        if (dependents[a].size() != dependents[b].size()) return dependents[a].size() < dependents[b].size();
+        return a > b;
+    };
+    std::vector<std::size_t> ready;
+    for (std::size_t i = 0; i < n; i++) {
+        if (!pending_deps[i]) ready.push_back(i);
+    }
+    std::make_heap(ready.begin(), ready.end(), by_priority);
+
+    std::vector<JobPool*> pools(n);
+    for (std::size_t i = 0; i < n; i++) {
+        if (!jobs[i].pool.empty()) pools[i] = &get_job_pool(jobs[i].pool);
+    }
+
+    std::mutex mutex;
+    std::condition_variable dispatch_cv, worker_cv;
+    std::deque<std::size_t> started;
+    std::vector<std::uint64_t> actual(n);
+    std::vector<ResourceUsage> usage(n);
+    std::size_t running = 0, finished = 0;
+    bool done = false;
+    std::exception_ptr error;
+    std::vector<std::pair<std::size_t, std::exception_ptr>> failures;
+    auto keep_going = get_keep_going();
+    bool interrupted = false;
+    // No new jobs start once this is set.
+    auto stopping = [&] { return interrupted || (keep_going && failures.size() >= keep_going); };
+    Throttle throttle;
+    InterruptGuard interrupt_guard;
+    // Owned by this call only, so cancellation ends with it and doesn't touch concurrent calls.
+    CancelToken cancel_token(g_cancel_token);
+    auto start_time = std::chrono::steady_clock::now();
+
+    auto worker = [&] {
+        g_cancel_token = &cancel_token;
+        std::unique_lock lock(mutex);
+        while (true) {
+            worker_cv.wait(lock, [&] { return done || !started.empty(); });
+            if (started.empty()) return;
+            auto idx = started.front();
+            started.pop_front();
+            lock.unlock();
+            auto job_start = std::chrono::steady_clock::now();
+            std::exception_ptr failure;
+            g_job_usage = &usage[idx];
+            g_holds_job_slot = use_slots;
+            try {
+                jobs[idx].action();
+            } catch (...) {
+                failure = std::current_exception();
+            }
+            g_holds_job_slot = false;
+            g_job_usage = nullptr;
+            auto duration = elapsed_ms(job_start);
+            lock.lock();
+            actual[idx] = duration;
+            if (failure) {
+                if (!error) error = failure;
+                failures.emplace_back(idx, failure);
+                // Fail-fast, running jobs are pointless now.
+                if (keep_going == 1) g_running_commands.cancel(cancel_token);
+            } else {
+                for (auto next : dependents[idx]) {
+                    if (!--pending_deps[next]) {
+                        ready.push_back(next);
+                        std::push_heap(ready.begin(), ready.end(), by_priority);
+                    }
+                }
+            }
+            throttle.finish(jobs[idx]);
+            if (pools[idx]) pools[idx]->release();
+            if (use_slots) get_job_slots().release();
+            running--;
+            g_logger.set_progress(++finished, n);
+            dispatch_cv.notify_one();
+        }
+    };
+
+    g_logger.set_progress(0, n);
+    std::vector<std::thread> workers;
+    auto worker_count = std::min(max_jobs ? max_jobs : get_max_jobs(), n);
+    for (std::size_t i = 0; i < worker_count; i++) {
+        workers.emplace_back(worker);
+    }
+
+    {
+        std::unique_lock lock(mutex);
+        while (true) {
+            // Jobs whose pool is full are set aside, so jobs behind them could start meanwhile.
+            if (!interrupted && g_interrupt_signal.load()) {
+                interrupted = true;
+                log("ERROR", "Interrupted, cancelling {} running jobs", running);
+                g_running_commands.cancel(cancel_token);
+            }
+            std::vector<std::size_t> pool_full;
+            while (!stopping() && !ready.empty() && running < worker_count && throttle.admit(jobs[ready.front()], running)) {
+                std::pop_heap(ready.begin(), ready.end(), by_priority);
+                auto idx = ready.back();
+                ready.pop_back();
+                if (pools[idx] && !pools[idx]->try_acquire()) {
+                    pool_full.push_back(idx);
+                    continue;
+                }
+                // Other schedulers hold every slot, checked again after the next sample interval at the latest.
+                if (use_slots && !get_job_slots().try_acquire()) {
+                    if (pools[idx]) pools[idx]->release();
+                    pool_full.push_back(idx);
+                    break;
+                }
+                throttle.start(jobs[idx]);
+                started.push_back(idx);
+                running++;
+                worker_cv.notify_one();
+            }
+            for (auto idx : pool_full) {
+                ready.push_back(idx);
+                std::push_heap(ready.begin(), ready.end(), by_priority);
+            }
+            if (running == 0 && (stopping() || ready.empty())) break;
+            // Wake up periodically to sample system load again while throttled.
+            dispatch_cv.wait_for(lock, g_throttle_policy.sample_interval);
+        }
+        done = true;
+        worker_cv.notify_all();
+    }
+
+    for (auto& t : workers) {
+        t.join();
+    }
+
+    if (interrupted) throw std::runtime_error("Build interrupted");
+    // Failures after the first one are only cancelled jobs in fail-fast mode.
+    if (keep_going != 1 && failures.size() > 1) {
+        for (auto [idx, failure] : failures) {
+            try {
+                std::rethrow_exception(failure);
+            } catch (const std::exception& e) {
+                log("ERROR", "Job {} failed: {}", jobs[idx].name, e.what());
+            } catch (...) {
+                log("ERROR", "Job {} failed", jobs[idx].name);
+            }
+        }
+        throw std::runtime_error(std::format("{} jobs failed", failures.size()));
+    }
+    if (error) std::rethrow_exception(error);
+
+    // Longest chain by actual durations.
+    std::vector<std::uint64_t> path(n);
+    std::vector<std::size_t> via(n, n);
+    std::size_t last = order.front();
+    for (auto idx : order) {
+        std::uint64_t head = 0;
+        for (auto dep : jobs[idx].deps) {
+            if (path[dep] >= head) {
+                head = path[dep];
+                via[idx] = dep;
+            }
+        }
+        path[idx] = head + actual[idx];
+        if (path[idx] > path[last]) last = idx;
+    }
+    summary.actual_critical_path = path[last];
+    for (auto idx = last; idx != n; idx = via[idx]) {
+        summary.critical_jobs.insert(summary.critical_jobs.begin(), jobs[idx].name);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (!usage[i].commands) continue;
+        summary.total_usage.add(usage[i]);
+        summary.job_usage.push_back({ jobs[i].name, actual[i], usage[i] });
+    }
+    summary.wall_time = elapsed_ms(start_time);
+    return summary;
+}
+
+// }}}
+
+// {{{Raw compilation thingy
+
+// Family of a compiler driver, for flags that differ between them.
+enum class CompilerFamily {
+    GCC,
+    Clang,
+    Unknown,
+};
+
+// Detect family of `compiler` from its `--version` output. Results are cached.
+inline CompilerFamily detect_compiler_family(const std::string& compiler) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, CompilerFamily> cache;
+    {
+        std::lock_guard lock(mutex);
+        if (auto it = cache.find(compiler); it != cache.end()) return it->second;
+    }
+
+    auto family = CompilerFamily::Unknown;
+    try {
+        auto result = execute_command({ compiler, "--version" });
+        if (result.ret_code == 0) {
+            if (result.stdout_content.find("clang") != std::string::npos) {
+                family = CompilerFamily::Clang;
+            } else if (result.stdout_content.find("Free Software Foundation") != std::string::npos) {
+                family = CompilerFamily::GCC;
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        log("WARNING", "Cannot detect family of compiler {}: {}", compiler, e.what());
+    }
+
+    std::lock_guard lock(mutex);
+    cache[compiler] = family;
+    return family;
+}
+
+// Generates argv from a compilation call. Defaults to C and if `is_cxx` was set to `true` then C++.
+inline std::vector<std::string> generate_compilation_argv(bool is_cxx, std::string_view src, std::string_view dest, const std::vector<std::string>& args, bool link_executable) {
+    std::vector<std::string> compiler_args;
+    compiler_args.push_back(is_cxx ? get_cxx() : get_cc());
+
+    if (!link_executable) {
+        compiler_args.push_back("-c");
+    }
+    compiler_args.push_back("-o");
+    compiler_args.push_back(std::string(dest));
+
+    for (const auto& arg : args) {
+        compiler_args.push_back(arg);
+    }
+
+    for (const auto& arg : get_env_flags(is_cxx ? "CXXFLAGS" : "CFLAGS")) {
+        compiler_args.push_back(arg);
+    }
+
+    if (link_executable) {
+        for (const auto& arg : get_env_flags("LDFLAGS")) {
+            compiler_args.push_back(arg);
+        }
+    }
+
+    compiler_args.push_back(std::string(src));
+    return compiler_args;
+}
+
+// Compile C source file `src` into artifact `dest`.
+// Optional arguments includes `args` to pass extra flags to the compiler and `link_executable` that denotes whether the artifact is an executable.
+inline CommandOutput compile_c_source(std::string_view src, std::string_view dest, const std::vector<std::string>& args = {}, bool link_executable = true) {
+    auto result = execute_tool(generate_compilation_argv(false, src, dest, args, link_executable), src);
+    g_stat_cache.invalidate(std::string { dest });
+    if (result.ret_code != 0) {
+        if (!g_running_commands.cancelled()) log("ERROR", "Compilation of {} failed", src);
+        throw std::runtime_error("Compilation failed");
+    }
+    return result;
+}
+
+// Compile C++ source file `src` into artifact `dest`.
+// Optional arguments includes `args` to pass extra flags to the compiler and `link_executable` that denotes whether the artifact is an executable.
+inline CommandOutput compile_cxx_source(std::string_view src, std::string_view dest, const std::vector<std::string>& args = {}, bool link_executable = true) {
+
+    auto result = execute_tool(generate_compilation_argv(true, src, dest, args, link_executable), src);
+    g_stat_cache.invalidate(std::string { dest });
+    if (result.ret_code != 0) {
+        if (!g_running_commands.cancelled()) log("ERROR", "Compilation of {} failed", src);
+        throw std::runtime_error("Compilation failed");
+    }
+    return result;
+}
+
+// }}}
+
+// {{{Raw linking thingy
 
 // Artifact type.
 enum class ArtifactType {
@@ -387,93 +2218,700 @@ inline std::string shared_library_name(std::string_view name) {
     #endif
 }
 
+inline std::string static_library_name(std::string_view name) {
+    return std::format("lib{}.a", name);
+}
+
+// Link-time optimization mode.
+enum class LtoMode {
+    None,
+    // Whole program is optimized as a single module.
+    Full,
+    // Modules are optimized in parallel with summaries of each other (ThinLTO), results are cached between builds.
+    // GCC has no ThinLTO and uses its partitioned LTO instead.
+    Thin,
+};
+
+// Options of debug information, see `Target::debug`.
+struct DebugOptions {
+    // Keep DWARF of each object in a `.dwo` file next to it (`-gsplit-dwarf`), so the linker doesn't copy it around.
+    bool split_dwarf = false;
+    // Let the linker build `.gdb_index`, so debuggers don't index DWARF on every start. Needs gold, lld or mold.
+    bool gdb_index = false;
+    // Compress debug sections of objects and artifacts (`-gz`).
+    bool compress = false;
+    // Package `.dwo` files into `<artifact>.dwp` after linking, so the artifact can be debugged without its objects.
+    // Implies `split_dwarf`.
+    bool dwp = false;
+};
+
+// Archiver that understands objects of `compiler`, which contain IR instead of machine code with LTO.
+// `$AR` always takes precedence.
+inline std::string get_archiver(LtoMode lto, const std::string& compiler) {
+    if (std::getenv("AR") || lto == LtoMode::None) return get_ar();
+    switch (detect_compiler_family(compiler)) {
+        case CompilerFamily::Clang: return "llvm-ar";
+        case CompilerFamily::GCC: return "gcc-ar";
+        default: return get_ar();
+    }
+}
+
+// Path of the file actually produced by `link_artifact` for `artifact`.
+inline std::filesystem::path artifact_file_name(const std::filesystem::path& artifact, ArtifactType artifact_type) {
+    switch (artifact_type) {
+        case ArtifactType::SharedLibrary:
+            return artifact.parent_path() / shared_library_name(artifact.filename().string());
+        case ArtifactType::StaticLibrary:
+            return artifact.parent_path() / static_library_name(artifact.filename().string());
+        default:
+            return artifact;
+    }
+}
+
 // Link (or archive) objects into artifact.
 // If `artifact_type` is set to `SharedLibrary` or `StaticLibrary`, file extension will be automatically added.
-inline void link_artifact(const std::vector<std::string>& objects, std::string artifact, std::vector<std::string> flags = {}, ArtifactType artifact_type = ArtifactType::Executable, bool use_cxx_stdlib = true) {
+// `lto` selects an archiver able to index objects built with LTO.
+inline void link_artifact(const std::vector<std::string>& objects, std::string artifact, std::vector<std::string> flags = {}, ArtifactType artifact_type = ArtifactType::Executable, bool use_cxx_stdlib = true, LtoMode lto = LtoMode::None) {
+    auto output = artifact_file_name(artifact, artifact_type).string();
     switch (artifact_type) {
         case ArtifactType::Executable: {
             auto linker = use_cxx_stdlib ? get_cxx() : get_cc();
             std::vector<std::string> cmd;
             cmd.push_back(linker);
             cmd.push_back("-o");
-            cmd.push_back(artifact);
+            cmd.push_back(output);
             for (const auto& i : flags) cmd.push_back(i);
             for (const auto& i : get_env_flags("LDFLAGS")) cmd.push_back(i);
             for (const auto& i : objects) cmd.push_back(i);
-            auto result = execute_command(cmd);
+            auto result = execute_tool(cmd, output);
+            g_stat_cache.invalidate(output);
             if (result.ret_code != 0) {
-                log("ERROR", "Linking failed with: \n{}", result.stderr_content);
+                if (!g_running_commands.cancelled()) log("ERROR", "Linking of {} failed", output);
                 throw std::runtime_error("Linking failed");
             }
         } break;
 
-        case ArtifactType::SharedLibrary: {
-            auto linker = use_cxx_stdlib ? get_cxx() : get_cc();
-            std::vector<std::string> cmd;
-            cmd.push_back(linker);
-            cmd.push_back("-o");
-            cmd.push_back(shared_library_name(artifact));
-            cmd.push_back("-shared");
-            for (const auto& i : flags) cmd.push_back(i);
-            for (const auto& i : get_env_flags("LDFLAGS")) cmd.push_back(i);
-            for (const auto& i : objects) cmd.push_back(i);
-            auto result = execute_command(cmd);
-            if (result.ret_code != 0) {
-                log("ERROR", "Linking failed with: \n{}", result.stderr_content);
-                throw std::runtime_error("Linking failed");
-            }
-        } break;
+        case ArtifactType::SharedLibrary: {
+            auto linker = use_cxx_stdlib ? get_cxx() : get_cc();
+            std::vector<std::string> cmd;
+            cmd.push_back(linker);
+            cmd.push_back("-o");
+            cmd.push_back(output);
+            cmd.push_back("-shared");
+            for (const auto& i : flags) cmd.push_back(i);
+            for (const auto& i : get_env_flags("LDFLAGS")) cmd.push_back(i);
+            for (const auto& i : objects) cmd.push_back(i);
+            auto result = execute_tool(cmd, output);
+            g_stat_cache.invalidate(output);
+            if (result.ret_code != 0) {
+                if (!g_running_commands.cancelled()) log("ERROR", "Linking of {} failed", output);
+                throw std::runtime_error("Linking failed");
+            }
+        } break;
+
+        case ArtifactType::StaticLibrary: {
+            // Archive from scratch, otherwise objects of removed sources stay in it.
+            std::filesystem::remove(output);
+            std::vector<std::string> cmd { get_archiver(lto, use_cxx_stdlib ? get_cxx() : get_cc()), "-rc", output };
+            for (const auto& i : objects) {
+                cmd.push_back(i);
+            }
+            auto result = execute_tool(cmd, output, false);
+            g_stat_cache.invalidate(output);
+            if (result.ret_code != 0) {
+                if (!g_running_commands.cancelled()) log("ERROR", "Archiving of {} failed", output);
+                throw std::runtime_error("Archiving failed");
+            }
+        } break;
+    }
+}
+
+// Path of the interface stub of shared library `artifact`, see `write_interface_stub`.
+inline std::string interface_stub_name(std::string_view artifact) {
+    return std::string { artifact } + ".ifs";
+}
+
+// Write the interface stub of shared library `artifact`: its exported dynamic symbols with their types and sizes of data
+// objects, listed by `nm -D` (`$NM` takes precedence). The stub is only rewritten when the interface changes, so
+// dependents could track it instead of the library and skip relinking when only its implementation changed.
+// If symbols can't be listed, the content hash of the library stands in for them.
+inline void write_interface_stub(const std::string& artifact) {
+    auto nm = std::getenv("NM");
+    auto result = execute_command({ nm ? nm : "nm", "-D", "--defined-only", "-P", artifact });
+    std::string interface;
+    if (result.ret_code == 0) {
+        std::vector<std::string> symbols;
+        std::size_t pos = 0;
+        while (pos < result.stdout_content.size()) {
+            auto end = result.stdout_content.find('\n', pos);
+            if (end == std::string::npos) end = result.stdout_content.size();
+            std::string_view line { result.stdout_content.data() + pos, end - pos };
+            pos = end + 1;
+            // Lines are `name type value size`. Addresses and sizes of functions change with their code, so only name and
+            // type are kept for them. Sizes of data objects are part of the ABI because of copy relocations.
+            auto name_end = line.find(' ');
+            if (name_end == std::string_view::npos || name_end + 2 > line.size()) continue;
+            std::string symbol(line.substr(0, name_end + 2));
+            if (std::string_view("DdBbRrVv").find(line[name_end + 1]) != std::string_view::npos) {
+                auto size_start = line.find(' ', name_end + 3);
+                if (size_start != std::string_view::npos) {
+                    symbol += line.substr(size_start);
+                }
+            }
+            symbols.push_back(std::move(symbol));
+        }
+        std::sort(symbols.begin(), symbols.end());
+        interface = "symbols\n";
+        for (const auto& symbol : symbols) {
+            interface += symbol + '\n';
+        }
+    } else {
+        log("WARNING", "Cannot list symbols of {}, dependents relink whenever it changes", artifact);
+        interface = std::format("hash {:016x}\n", hash_file(artifact));
+    }
+
+    auto stub = interface_stub_name(artifact);
+    {
+        std::ifstream ifs(stub, std::ios::binary);
+        std::string existing((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        if (ifs && existing == interface) return;
+    }
+    auto tmp = std::format("{}.tmp.{}", stub, getpid());
+    {
+        std::ofstream ofs(tmp, std::ios::binary);
+        ofs << interface;
+    }
+    std::filesystem::rename(tmp, stub);
+    g_stat_cache.invalidate(stub);
+}
+
+// DWARF packager, `$DWP` takes precedence.
+// llvm-dwp is preferred because GNU dwp doesn't understand DWARF 5, which GCC emits by default since GCC 11.
+inline std::string get_dwp() {
+    if (auto dwp = std::getenv("DWP")) return dwp;
+    return find_program("llvm-dwp").value_or("dwp");
+}
+
+// Package `.dwo` files referenced by `artifact` into `<artifact>.dwp`.
+inline void package_split_dwarf(const std::string& artifact) {
+    auto output = artifact + ".dwp";
+    auto result = execute_tool({ get_dwp(), "-e", artifact, "-o", output }, output, false);
+    g_stat_cache.invalidate(output);
+    if (result.ret_code != 0) {
+        log("ERROR", "Packaging debug info of {} failed", artifact);
+        throw std::runtime_error("Packaging debug info failed");
+    }
+}
+
+// }}}
+
+// {{{ Installing
+
+// Check if two files have identical content.
+inline bool same_file_content(const std::string& a, const std::string& b) {
+    std::ifstream ia(a, std::ios::binary), ib(b, std::ios::binary);
+    if (!ia || !ib) return false;
+    std::string ba(1 << 16, '\0'), bb(1 << 16, '\0');
+    while (true) {
+        ia.read(ba.data(), ba.size());
+        ib.read(bb.data(), bb.size());
+        if (ia.gcount() != ib.gcount()) return false;
+        if (ia.gcount() == 0) return true;
+        if (std::memcmp(ba.data(), bb.data(), ia.gcount())) return false;
+    }
+}
+
+// Copy content of `in` into `out`: reflink if the filesystem supports it, `copy_file_range` otherwise,
+// and plain read/write as the last resort. Returns false on failure with errno set.
+inline bool copy_file_content(int in, int out, std::uint64_t size) {
+#ifdef __linux__
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) return true;
+#endif
+    std::uint64_t copied = 0;
+    while (copied < size) {
+        auto n = copy_file_range(in, nullptr, out, nullptr, size - copied, 0);
+        if (n <= 0) break;
+        copied += n;
+    }
+    if (copied == size) return true;
+    // Cross-filesystem copies fail on older kernels, restart from where we stopped.
+    if (lseek(in, copied, SEEK_SET) < 0 || lseek(out, copied, SEEK_SET) < 0) return false;
+#endif
+    char buffer[1 << 16];
+    while (true) {
+        auto n = read(in, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) return true;
+        for (ssize_t written = 0; written < n;) {
+            auto w = write(out, buffer + written, n - written);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return false;
+            written += w;
+        }
+    }
+}
+
+// Install file `src` to `dest`, creating parent directories and keeping the permission bits.
+// Returns false without touching `dest` if it already has the same content and mode.
+// `dest` is replaced atomically, so a running program using it never sees a partial file.
+inline bool install_file(const std::string& src, const std::string& dest) {
+    struct stat src_stat, dest_stat;
+    if (stat(src.c_str(), &src_stat)) {
+        throw std::runtime_error(std::format("Cannot install {} because of: {}", src, strerror(errno)));
+    }
+    auto mode = src_stat.st_mode & 07777;
+    if (stat(dest.c_str(), &dest_stat) == 0 && dest_stat.st_size == src_stat.st_size
+        && (dest_stat.st_mode & 07777) == mode && same_file_content(src, dest)) {
+        return false;
+    }
+
+    auto parent = std::filesystem::path(dest).parent_path();
+    if (!parent.empty()) std::filesystem::create_directories(parent);
+    auto tmp = std::format("{}.oinbs-tmp-{}", dest, getpid());
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        throw std::runtime_error(std::format("Cannot read {} because of: {}", src, strerror(errno)));
+    }
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out < 0) {
+        auto error = errno;
+        close(in);
+        throw std::runtime_error(std::format("Cannot write {} because of: {}", tmp, strerror(error)));
+    }
+    bool ok = copy_file_content(in, out, src_stat.st_size) && fchmod(out, mode) == 0;
+    auto error = errno;
+    close(in);
+    if (close(out)) {
+        ok = false;
+        error = errno;
+    }
+    if (ok && rename(tmp.c_str(), dest.c_str())) {
+        ok = false;
+        error = errno;
+    }
+    if (!ok) {
+        unlink(tmp.c_str());
+        throw std::runtime_error(std::format("Failed to install {} to {} because of: {}", src, dest, strerror(error)));
+    }
+    g_stat_cache.invalidate(dest);
+    return true;
+}
+
+// }}}
+
+// {{{ More compilation thingy
+
+// Check if `dest` exists and is newer than `src`.
+inline bool is_up_to_date(std::string_view dest, std::string_view src) {
+    return g_stat_cache.get(dest).exists && is_newer(dest, src);
+}
+
+// If the `dest` doesn't exist or older than `src`, call `compile_cxx_source` with given arguments.
+inline void compile_cxx_if_necessary(std::string_view src, std::string_view dest, const std::vector<std::string>& args = {}, bool link_executable = true) {
+    if (is_up_to_date(dest, src)) {
+        return;
+    }
+
+    compile_cxx_source(src, dest, args, link_executable);
+}
+
+// If the `dest` doesn't exist or older than `src`, call `compile_c_source` with given arguments.
+inline void compile_c_if_necessary(std::string_view src, std::string_view dest, const std::vector<std::string>& args = {}, bool link_executable = true) {
+    if (is_up_to_date(dest, src)) {
+        return;
+    }
+
+    compile_c_source(src, dest, args, link_executable);
+}
+
+// Rebuild the build script.
+inline void rebuild_urself(int argc, char **argv, std::source_location loc = std::source_location::current()) {
+    using namespace std::string_literals;
+    log("INFO", "Self-rebuilding... ");
+    compile_cxx_source(loc.file_name(), argv[0], { "-std=c++20"s });
+    execute_nofork(argv);
+}
+
+// Rebuild the build script if source has been modified.
+inline void go_rebuild_urself(int argc, char **argv, std::source_location loc = std::source_location::current()) {
+    g_build_script_name = argv[0];
+    g_build_script_source = loc.file_name();
+    if (is_newer(loc.file_name(), argv[0])) {
+        rebuild_urself(argc, argv, loc);
+    }
+}
+
+// }}}
+
+// {{{ Coroutines
+
+// Build steps as C++20 coroutines: `co_await compile(...)`, `co_await link(...)` and `co_await run(...)` inside a
+// `Step` suspend it while the command runs on a thread of `run_step`, so independent steps started with `when_all` run
+// concurrently while each of them reads as plain sequential code. Steps may resume on any thread of `run_step`.
+
+template <typename T> class Step;
+
+// Part of `Step` promises independent of the result type.
+struct StepPromiseBase {
+    // Resumed once the step finishes.
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    struct ResumeContinuation {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+
+    // Steps are lazy, they start when awaited.
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    ResumeContinuation final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() {
+        error = std::current_exception();
+    }
+};
+
+template <typename T>
+struct StepPromise : StepPromiseBase {
+    std::optional<T> value;
+
+    Step<T> get_return_object();
+
+    void return_value(T result) {
+        value = std::move(result);
+    }
+
+    T result() {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct StepPromise<void> : StepPromiseBase {
+    Step<void> get_return_object();
+
+    void return_void() {}
+
+    void result() {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+// A build step producing `T`, started by `co_await`ing it from another step or by `run_step`.
+template <typename T = void>
+class [[nodiscard]] Step {
+    public:
+    using promise_type = StepPromise<T>;
+
+    explicit Step(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    Step(Step&& other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+    Step& operator=(Step&& other) noexcept {
+        if (this != &other) {
+            if (m_handle) m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, {});
+        }
+        return *this;
+    }
+    Step(const Step&) = delete;
+    Step& operator=(const Step&) = delete;
+    ~Step() {
+        if (m_handle) m_handle.destroy();
+    }
+
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        m_handle.promise().continuation = awaiting;
+        return m_handle;
+    }
+
+    T await_resume() {
+        return m_handle.promise().result();
+    }
+
+    // Awaitable finishing together with the step, leaving its result to `result`.
+    auto completion() noexcept {
+        struct Completion {
+            std::coroutine_handle<promise_type> handle;
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            void await_resume() noexcept {}
+        };
+        return Completion { m_handle };
+    }
+
+    // Result of a finished step, rethrowing its exception.
+    T result() {
+        return m_handle.promise().result();
+    }
+
+    private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template <typename T>
+inline Step<T> StepPromise<T>::get_return_object() {
+    return Step<T> { std::coroutine_handle<StepPromise<T>>::from_promise(*this) };
+}
+
+inline Step<void> StepPromise<void>::get_return_object() {
+    return Step<void> { std::coroutine_handle<StepPromise<void>>::from_promise(*this) };
+}
+
+// Coroutine that starts right away and frees itself once done, to start steps from plain code.
+struct DetachedStep {
+    struct promise_type {
+        DetachedStep get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Start `step` and call `on_done` once it finishes, possibly on another thread.
+template <typename T, typename F>
+inline DetachedStep start_step(Step<T>& step, F on_done) {
+    co_await step.completion();
+    on_done();
+}
+
+class StepExecutor;
+
+// Executor of the `run_step` the current thread works for, null outside of it.
+inline thread_local StepExecutor *g_step_executor = nullptr;
+
+// Threads running blocking work of steps. Only as many of them as free slots of `get_job_slots()` do work at once.
+class StepExecutor {
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_queue;
+    std::vector<std::thread> m_threads;
+    bool m_stopping = false;
+
+    public:
+    // Commands of steps are cancelled together with the job calling `run_step`, if any.
+    explicit StepExecutor(std::size_t threads) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); i++) {
+            m_threads.emplace_back([this, token = g_cancel_token] {
+                g_step_executor = this;
+                g_cancel_token = token;
+                std::unique_lock lock(m_mutex);
+                while (true) {
+                    m_cv.wait(lock, [&] { return m_stopping || !m_queue.empty(); });
+                    if (m_queue.empty()) return;
+                    auto work = std::move(m_queue.front());
+                    m_queue.pop_front();
+                    lock.unlock();
+                    work();
+                    lock.lock();
+                }
+            });
+        }
+    }
+
+    ~StepExecutor() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stopping = true;
+        }
+        m_cv.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    StepExecutor(const StepExecutor&) = delete;
+    StepExecutor& operator=(const StepExecutor&) = delete;
+
+    void post(std::function<void()> work) {
+        {
+            std::lock_guard lock(m_mutex);
+            m_queue.push_back(std::move(work));
+        }
+        m_cv.notify_one();
+    }
+};
+
+// Awaitable running blocking `work` on a thread of `run_step` and resuming the step there afterwards.
+// Outside of `run_step`, `work` runs right away. Either way `work` holds a slot of `get_job_slots()`.
+class BlockingWork {
+    std::function<void()> m_work;
+    std::exception_ptr m_error;
+    bool m_inline = false;
+
+    public:
+    explicit BlockingWork(std::function<void()> work) : m_work(std::move(work)) {}
+
+    bool await_ready() noexcept {
+        m_inline = !g_step_executor;
+        return m_inline;
+    }
+
+    void await_suspend(std::coroutine_handle<> awaiting) {
+        g_step_executor->post([this, awaiting] {
+            try {
+                JobSlot slot;
+                m_work();
+            } catch (...) {
+                m_error = std::current_exception();
+            }
+            awaiting.resume();
+        });
+    }
+
+    void await_resume() {
+        if (m_inline) {
+            JobSlot slot;
+            m_work();
+        }
+        if (m_error) std::rethrow_exception(m_error);
+    }
+};
+
+// Counts finished steps of `when_all`, resuming the awaiting step after the last one.
+class StepLatch {
+    std::atomic<std::size_t> m_count;
+    std::coroutine_handle<> m_continuation;
+
+    public:
+    // One more than `count`, taken by the awaiting step itself.
+    explicit StepLatch(std::size_t count) : m_count(count + 1) {}
+
+    void arrive() {
+        if (m_count.fetch_sub(1, std::memory_order_acq_rel) == 1) m_continuation.resume();
+    }
+
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        m_continuation = awaiting;
+        return m_count.fetch_sub(1, std::memory_order_acq_rel) != 1;
+    }
 
-        case ArtifactType::StaticLibrary: {
-            std::vector<std::string> cmd { "ar", "-rc" };
-            for (const auto& i : objects) {
-                cmd.push_back(i);
+    void await_resume() noexcept {}
+};
+
+// Run `steps` concurrently, finishing with their results once all of them are done.
+// Every step runs to the end even if another one fails, the first failure is rethrown afterwards.
+template <typename T>
+inline Step<std::conditional_t<std::is_void_v<T>, void, std::vector<T>>> when_all(std::vector<Step<T>> steps) {
+    StepLatch latch(steps.size());
+    for (auto& step : steps) {
+        start_step(step, [&latch] { latch.arrive(); });
+    }
+    co_await latch;
+
+    std::exception_ptr error;
+    if constexpr (std::is_void_v<T>) {
+        for (auto& step : steps) {
+            try {
+                step.result();
+            } catch (...) {
+                if (!error) error = std::current_exception();
             }
-            auto result = execute_command(cmd);
-            if (result.ret_code != 0) {
-                log("ERROR", "Archiving failed with: \n{}", result.stderr_content);
-                throw std::runtime_error("Archiving failed");
+        }
+        if (error) std::rethrow_exception(error);
+    } else {
+        std::vector<T> results;
+        for (auto& step : steps) {
+            try {
+                results.push_back(step.result());
+            } catch (...) {
+                if (!error) error = std::current_exception();
             }
-        } break;
+        }
+        if (error) std::rethrow_exception(error);
+        co_return results;
     }
 }
 
-// }}}
-
-// {{{ More compilation thingy
+template <typename T, typename... Rest>
+inline auto when_all(Step<T> first, Rest... rest) {
+    std::vector<Step<T>> steps;
+    steps.push_back(std::move(first));
+    (steps.push_back(std::move(rest)), ...);
+    return when_all(std::move(steps));
+}
 
-// If the `dest` doesn't exist or older than `src`, call `compile_cxx_source` with given arguments.
-inline void compile_cxx_if_necessary(std::string_view src, std::string_view dest, const std::vector<std::string>& args = {}, bool link_executable = true) {
-    if (std::filesystem::exists(dest) && is_newer(dest, src)) {
-        return;
+// Run `step` to completion, doing blocking work of it and every step it awaits on `get_max_jobs()` threads.
+// The calling thread lends its slot of `get_job_slots()` while waiting, so nested `run_step` calls and targets built
+// from steps share the `-j` limit with it.
+template <typename T>
+inline T run_step(Step<T> step) {
+    StepExecutor executor(get_max_jobs());
+    LentJobSlot lent_slot;
+    auto outer = std::exchange(g_step_executor, &executor);
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    start_step(step, [&] {
+        std::lock_guard lock(mutex);
+        done = true;
+        cv.notify_all();
+    });
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&] { return done; });
     }
-
-    compile_cxx_source(src, dest, args, link_executable);
+    g_step_executor = outer;
+    return step.result();
 }
 
-// If the `dest` doesn't exist or older than `src`, call `compile_c_source` with given arguments.
-inline void compile_c_if_necessary(std::string_view src, std::string_view dest, const std::vector<std::string>& args = {}, bool link_executable = true) {
-    if (std::filesystem::exists(dest) && is_newer(dest, src)) {
-        return;
+// Step doing blocking `work` on a thread of `run_step`, e.g. running a tool or writing a generated file.
+template <typename T>
+inline Step<T> blocking_step(std::function<T()> work) {
+    if constexpr (std::is_void_v<T>) {
+        co_await BlockingWork(std::move(work));
+    } else {
+        std::optional<T> result;
+        co_await BlockingWork([&] {
+            result = work();
+        });
+        co_return std::move(*result);
     }
+}
 
-    compile_c_source(src, dest, args, link_executable);
+// Step running a command, see `execute_command`.
+inline Step<CommandOutput> run(std::vector<std::string> argv, CommandOptions options) {
+    return blocking_step<CommandOutput>([argv = std::move(argv), options = std::move(options)] {
+        return execute_command(argv, true, {}, options);
+    });
 }
 
-// Rebuild the build script.
-inline void rebuild_urself(int argc, char **argv, std::source_location loc = std::source_location::current()) {
-    using namespace std::string_literals;
-    log("INFO", "Self-rebuilding... ");
-    compile_cxx_source(loc.file_name(), argv[0], { "-std=c++20"s });
-    execute_nofork(argv);
+// Not a default argument, GCC 12 miscompiles temporaries of default arguments inside `co_await`.
+inline Step<CommandOutput> run(std::vector<std::string> argv) {
+    return run(std::move(argv), CommandOptions {});
 }
 
-// Rebuild the build script if source has been modified.
-inline void go_rebuild_urself(int argc, char **argv, std::source_location loc = std::source_location::current()) {
-    g_build_script_name = argv[0];
-    if (is_newer(loc.file_name(), argv[0])) {
-        rebuild_urself(argc, argv, loc);
-    }
+// Step compiling `src` into `dest`, as C++ or C by its extension, see `compile_cxx_source`.
+inline Step<CommandOutput> compile(std::string src, std::string dest, std::vector<std::string> args = {}, bool link_executable = true) {
+    return blocking_step<CommandOutput>([src = std::move(src), dest = std::move(dest), args = std::move(args), link_executable] {
+        return is_cxx_source(src) ? compile_cxx_source(src, dest, args, link_executable) : compile_c_source(src, dest, args, link_executable);
+    });
+}
+
+// Step linking `objects` into `artifact` in pool `link`, see `link_artifact`.
+inline Step<void> link(std::vector<std::string> objects, std::string artifact, std::vector<std::string> flags = {}, ArtifactType artifact_type = ArtifactType::Executable, bool use_cxx_stdlib = true, LtoMode lto = LtoMode::None) {
+    return blocking_step<void>([objects = std::move(objects), artifact = std::move(artifact), flags = std::move(flags), artifact_type, use_cxx_stdlib, lto] {
+        PoolSlot slot("link");
+        link_artifact(objects, artifact, flags, artifact_type, use_cxx_stdlib, lto);
+    });
 }
 
 // }}}
@@ -487,40 +2925,34 @@ inline void invoke_build_script(std::filesystem::path path, std::vector<std::str
     if (!path.has_parent_path()) {
         throw std::runtime_error(std::format("Path {} doesn't have parent path", path.string()));
     }
-    auto cwd = std::filesystem::current_path();
-    std::filesystem::current_path(path.parent_path());
-
-    auto bs_build_name = path.filename().string();
-    auto bs_build_src = bs_build_name;
+    // Working directory of this process is left alone, so build scripts could be invoked from concurrent jobs.
+    auto dir = path.parent_path();
+    auto bs_build_src = path.filename().string();
     if (!is_cxx_source(bs_build_src)) {
-        std::filesystem::current_path(cwd);
-        throw std::runtime_error(std::format("{} is not a valid C++ source file", bs_build_name));
+        throw std::runtime_error(std::format("{} is not a valid C++ source file", bs_build_src));
     }
-    bs_build_name = strip_file_extension(bs_build_src);
+    auto bs_build_name = strip_file_extension(bs_build_src);
 
-    if (!std::filesystem::exists(bs_build_name)) {
+    PoolSlot slot("build_script");
+    // Both bootstrapping and running happen in the script's directory, where it rebuilds itself later.
+    CommandOptions options;
+    options.cwd = dir.string();
+    if (!std::filesystem::exists(dir / bs_build_name)) {
         log("INFO", "Bootstrapping build script {}", path.string());
-        try {
-            compile_cxx_source(bs_build_src, bs_build_name, { "-std=c++20" });
-        } catch (const std::runtime_error& e) {
-            log("ERROR", "Failed to bootstrap build script: {}", e.what());
-            std::filesystem::current_path(cwd);
-            throw e;
+        auto result = execute_command(generate_compilation_argv(true, bs_build_src, bs_build_name, { "-std=c++20" }, true), false, {}, options);
+        if (result.ret_code) {
+            log("ERROR", "Failed to bootstrap build script {}", path.string());
+            throw std::runtime_error("Compilation failed");
         }
         log("INFO", "Build script successfully bootstrapped");
     }
 
     log("INFO", "Executing build script {}", path.string());
-    std::vector<std::string> argv = args;
     args.insert(args.begin(), "./" + bs_build_name);
-    auto result = execute_command(args, false);
+    auto result = execute_command(args, false, {}, options);
     if (result.ret_code) {
-        std::filesystem::current_path(cwd);
         throw std::runtime_error(std::format("Failed to execute build script {}", path.string()));
     }
-
-    // Restore cwd.
-    std::filesystem::current_path(cwd);
 }
 
 // }}}
@@ -619,6 +3051,48 @@ FEATURE_PKG_CONFIG_END
 
 // {{{ Compilation Database stuff
 
+// Per translation unit analyzer run by `CompilationDatabase::analyze`, clang-tidy by default.
+struct Analyzer {
+    // Command run for every source, `{src}` is replaced with the source. Compile flags of the source follow after
+    // `flags_prefix`, without flags writing the object or its depfile.
+    std::vector<std::string> argv = { "clang-tidy", "--quiet", "{src}" };
+    // Arguments separating `argv` from compile flags, `--` ends options of clang tooling. Empty for compiler-based analyzers.
+    std::vector<std::string> flags_prefix = { "--" };
+    // Files configuring the analyzer, sources are analyzed again when any of them changes.
+    std::vector<std::string> config_files = { ".clang-tidy" };
+    // Directory of cached results.
+    std::string cache_dir = "./build/analysis";
+    // File the merged findings are written to, none if empty.
+    std::string report;
+    // Name of the `JobPool` the analyzer runs in, empty for none.
+    std::string pool;
+};
+
+// Compile flags `args` without the ones writing outputs (`-o`, `-MD`, `-MMD`, `-MF` and such), so a tool given them
+// doesn't overwrite the object or its depfile.
+inline std::vector<std::string> strip_output_flags(const std::vector<std::string>& args) {
+    std::vector<std::string> result;
+    for (std::size_t i = 0; i < args.size(); i++) {
+        const auto& arg = args[i];
+        if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+            i++;
+            continue;
+        }
+        bool dependency_flag = arg == "-MD" || arg == "-MMD" || arg == "-MP" || arg.starts_with("-MF") || arg.starts_with("-MT") || arg.starts_with("-MQ");
+        if (!dependency_flag) result.push_back(arg);
+    }
+    return result;
+}
+
+// Findings of an analyzer on one source.
+struct AnalysisResult {
+    std::string src;
+    int ret_code = 0;
+    std::string findings;
+    // Whether the result came from the cache.
+    bool cached = false;
+};
+
 class CompilationDatabase {
     struct Entry {
         std::vector<std::string> args;
@@ -633,13 +3107,47 @@ class CompilationDatabase {
         std::vector<std::string> args;
         bool link_executable;
         bool is_cxx;
+        // Estimated peak memory in bytes, 0 means learning it from the build log.
+        std::uint64_t memory_weight = 0;
+        // Where facts about the output are recorded, may be null.
+        BuildLog* log = nullptr;
+        // Depfile written by the compiler, recorded into `log` as header dependencies. Empty if none.
+        std::string depfile = "";
+        // Files other than `src` the output depends on, e.g. profiles.
+        std::vector<std::string> inputs = {};
+        // Files produced besides `dest`, e.g. split DWARF. The operation reruns if any of them is missing.
+        std::vector<std::string> outputs = {};
     };
 
 
     std::vector<Operation> m_operations;
     bool m_use_lazy_compilation;
     bool m_dummy;
-    std::string m_render_entry(const Entry& entry) {
+
+    // Whether output of `operation` is newer than its source and every recorded header dependency.
+    bool m_is_up_to_date(const Operation& operation) {
+        auto dest = g_stat_cache.get(operation.dest);
+        if (!dest.exists) return false;
+        auto src = g_stat_cache.get(operation.src);
+        if (!src.exists || src.mtime >= dest.mtime) return false;
+        for (const auto& output : operation.outputs) {
+            if (!g_stat_cache.exists(output)) return false;
+        }
+        for (const auto& input : operation.inputs) {
+            auto input_stat = g_stat_cache.get(input);
+            if (!input_stat.exists || input_stat.mtime >= dest.mtime) return false;
+        }
+        if (!operation.log) return true;
+        return operation.log->all_deps(operation.dest, [&](const std::string& dep) {
+            auto dep_stat = g_stat_cache.get(dep);
+            return dep_stat.exists && dep_stat.mtime < dest.mtime;
+        });
+    }
+
+    std::string m_render_entry(const Entry& entry, const std::string& cwd) {
+        auto absolute = [&cwd](const std::string& path) {
+            return path.starts_with('/') ? path : cwd + "/" + path;
+        };
         std::string args;
         if (entry.args.empty()) {
             args = "[]";
@@ -656,11 +3164,11 @@ class CompilationDatabase {
         result += "\"arguments\": ";
         result += args;
         result += ", \"directory\": ";
-        result += escape_string(std::filesystem::current_path().string());
+        result += escape_string(cwd);
         result += ", \"file\": ";
-        result += escape_string(std::filesystem::absolute(entry.file).string());
+        result += escape_string(absolute(entry.file));
         result += ", \"output\": ";
-        result += escape_string(std::filesystem::absolute(entry.output).string());
+        result += escape_string(absolute(entry.output));
         result += "}";
         return result;
     }
@@ -674,22 +3182,226 @@ class CompilationDatabase {
         m_operations.push_back({ src, dest, args, link_executable, true});
     }
 
-    void perform() {
-        auto cmp_c = oinbs::compile_c_source;
-        auto cmp_cxx = oinbs::compile_cxx_source;
-        if (m_use_lazy_compilation) {
-            cmp_c = oinbs::compile_c_if_necessary;
-            cmp_cxx = oinbs::compile_cxx_if_necessary;
+    // Set hints for scheduling the last added operation.
+    // `memory_weight` is the estimated peak memory in bytes (0 to learn it), facts of the output will be recorded into `log` if it's not null.
+    // If `depfile` isn't empty, it's read after compilation and recorded into `log` as header dependencies.
+    void set_last_operation_hints(std::uint64_t memory_weight, BuildLog* log, const std::string& depfile = "") {
+        if (m_operations.empty()) return;
+        m_operations.back().memory_weight = memory_weight;
+        m_operations.back().log = log;
+        m_operations.back().depfile = depfile;
+    }
+
+    // Add a file the output of the last added operation depends on, besides its source.
+    void add_last_operation_input(const std::string& path) {
+        if (m_operations.empty()) return;
+        m_operations.back().inputs.push_back(path);
+    }
+
+    // Add a file produced by the last added operation, besides its output.
+    void add_last_operation_output(const std::string& path) {
+        if (m_operations.empty()) return;
+        m_operations.back().outputs.push_back(path);
+    }
+
+    // Whether every operation starting from the `first`-th one is up to date, without running anything.
+    // `newest` is set to the modification time of the newest output.
+    bool is_up_to_date(std::size_t first, std::int64_t& newest) {
+        newest = 0;
+        if (!m_use_lazy_compilation) return false;
+        for (auto idx = first; idx < m_operations.size(); idx++) {
+            if (!m_is_up_to_date(m_operations[idx])) return false;
+            newest = std::max(newest, g_stat_cache.get(m_operations[idx].dest).mtime);
         }
-        for (auto operation : m_operations) {
-            if (operation.is_cxx) {
-                cmp_cxx(operation.src, operation.dest, operation.args, operation.link_executable);
-            } else {
-                cmp_c(operation.src, operation.dest, operation.args, operation.link_executable);
+        return true;
+    }
+
+    // Append jobs of operations starting from the `first`-th one to `jobs`, returning their indices.
+    std::vector<std::size_t> schedule(std::vector<Job>& jobs, std::size_t first = 0) {
+        std::vector<std::size_t> result;
+        for (auto idx = first; idx < m_operations.size(); idx++) {
+            const auto& operation = m_operations[idx];
+            Job job;
+            job.name = operation.dest;
+            job.memory_weight = operation.memory_weight;
+            if (operation.log) {
+                if (auto record = operation.log->get(operation.dest)) {
+                    if (!job.memory_weight) job.memory_weight = record->peak_memory;
+                    job.predicted_duration = record->duration;
+                }
+            }
+            job.action = [this, idx] {
+                const auto& operation = m_operations[idx];
+                if (m_use_lazy_compilation && m_is_up_to_date(operation)) {
+                    return;
+                }
+                auto start = std::chrono::steady_clock::now();
+                auto result = operation.is_cxx
+                    ? oinbs::compile_cxx_source(operation.src, operation.dest, operation.args, operation.link_executable)
+                    : oinbs::compile_c_source(operation.src, operation.dest, operation.args, operation.link_executable);
+                for (const auto& output : operation.outputs) {
+                    g_stat_cache.invalidate(output);
+                }
+                if (operation.log) {
+                    operation.log->update(operation.dest, [&](BuildRecord& record) {
+                        record.set_usage(result.usage, elapsed_ms(start));
+                    });
+                    if (!operation.depfile.empty()) {
+                        std::ifstream ifs(operation.depfile);
+                        std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+                        operation.log->set_deps(operation.dest, parse_depfile(content));
+                        ifs.close();
+                        std::filesystem::remove(operation.depfile);
+                    }
+                }
+            };
+            result.push_back(jobs.size());
+            jobs.push_back(std::move(job));
+        }
+        return result;
+    }
+
+    // Run `analyzer` over every source in parallel, skipping sources whose result is cached. Results are cached by
+    // content of the source and its headers (as recorded by the last compilation), the command line and content of
+    // analyzer config files, so sources compiled at least once are only analyzed again when something they see changed.
+    // Findings are logged, merged into `analyzer.report` if set, and returned in the order sources were added.
+    std::vector<AnalysisResult> analyze(const Analyzer& analyzer) {
+        std::vector<const Operation*> operations;
+        std::unordered_set<std::string> seen;
+        for (const auto& operation : m_operations) {
+            if (seen.insert(operation.src).second) operations.push_back(&operation);
+        }
+        std::filesystem::create_directories(analyzer.cache_dir);
+
+        std::uint64_t config_hash = 0;
+        for (const auto& arg : analyzer.argv) {
+            config_hash = hash_combine(config_hash, hash_bytes(arg));
+        }
+        for (const auto& config : analyzer.config_files) {
+            config_hash = hash_combine(config_hash, g_stat_cache.exists(config) ? hash_file(config) : 0);
+        }
+
+        std::vector<AnalysisResult> results(operations.size());
+        std::vector<Job> jobs;
+        for (std::size_t i = 0; i < operations.size(); i++) {
+            Job job;
+            job.name = operations[i]->src;
+            job.pool = analyzer.pool;
+            job.action = [&, i] {
+                const auto& operation = *operations[i];
+                auto& result = results[i];
+                result.src = operation.src;
+
+                std::vector<std::string> argv;
+                for (auto arg : analyzer.argv) {
+                    for (auto pos = arg.find("{src}"); pos != std::string::npos; pos = arg.find("{src}", pos + operation.src.size())) {
+                        arg.replace(pos, 5, operation.src);
+                    }
+                    argv.push_back(std::move(arg));
+                }
+                argv.insert(argv.end(), analyzer.flags_prefix.begin(), analyzer.flags_prefix.end());
+                for (auto& flag : strip_output_flags(operation.args)) {
+                    argv.push_back(std::move(flag));
+                }
+                for (const auto& flag : get_env_flags(operation.is_cxx ? "CXXFLAGS" : "CFLAGS")) {
+                    argv.push_back(flag);
+                }
+
+                // Without known headers, nothing tells whether a cached result is still valid.
+                std::optional<std::string> cache_file;
+                if (operation.log && operation.log->has_deps(operation.dest)) {
+                    std::vector<std::string> deps;
+                    operation.log->all_deps(operation.dest, [&](const std::string& dep) {
+                        deps.push_back(dep);
+                        return true;
+                    });
+                    auto key = hash_combine(config_hash, hash_file(operation.src));
+                    for (const auto& arg : argv) {
+                        key = hash_combine(key, hash_bytes(arg));
+                    }
+                    for (const auto& dep : deps) {
+                        key = hash_combine(key, g_stat_cache.exists(dep) ? operation.log->file_hash(dep) : 0);
+                    }
+                    cache_file = (std::filesystem::path(analyzer.cache_dir) / std::format("{:016x}", key)).string();
+                    std::ifstream ifs(*cache_file, std::ios::binary);
+                    if (ifs >> result.ret_code) {
+                        ifs.get();
+                        result.findings.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+                        result.cached = true;
+                        return;
+                    }
+                }
+
+                auto output = execute_command(argv);
+                result.ret_code = output.ret_code;
+                result.findings = output.stdout_content;
+                if (output.ret_code != 0) result.findings += output.stderr_content;
+                if (cache_file) {
+                    auto tmp = std::format("{}.tmp.{}", *cache_file, getpid());
+                    {
+                        std::ofstream ofs(tmp, std::ios::binary);
+                        ofs << result.ret_code << '\n' << result.findings;
+                    }
+                    std::filesystem::rename(tmp, *cache_file);
+                }
+            };
+            jobs.push_back(std::move(job));
+        }
+        // Header hashes computed for cache keys are kept for the next run.
+        try {
+            run_jobs(jobs);
+        } catch (...) {
+            save_logs();
+            throw;
+        }
+        save_logs();
+
+        std::size_t cached = 0, with_findings = 0;
+        std::string report;
+        for (const auto& result : results) {
+            cached += result.cached;
+            if (result.findings.empty() && result.ret_code == 0) continue;
+            with_findings++;
+            g_diagnostics_printer.print(result.src, result.findings);
+            report += result.findings;
+            if (!report.empty() && report.back() != '\n') report += '\n';
+        }
+        if (!analyzer.report.empty()) {
+            std::ofstream ofs(analyzer.report);
+            ofs << report;
+        }
+        log("INFO", "Analyzed {} sources ({} cached), {} with findings", results.size(), cached, with_findings);
+        return results;
+    }
+
+    // Number of operations added so far.
+    std::size_t size() const {
+        return m_operations.size();
+    }
+
+    // Save build logs touched by the operations.
+    void save_logs() {
+        std::vector<BuildLog*> saved;
+        for (const auto& operation : m_operations) {
+            if (operation.log && std::find(saved.begin(), saved.end(), operation.log) == saved.end()) {
+                operation.log->save();
+                saved.push_back(operation.log);
             }
         }
     }
 
+    void perform() {
+        std::vector<Job> jobs;
+        schedule(jobs);
+        try {
+            run_jobs(jobs).print();
+        } catch (...) {
+            save_logs();
+            throw;
+        }
+        save_logs();
+    }
+
     std::string generate_database() {
 
         // Dummy compdb doesn't generate anything.
@@ -709,33 +3421,161 @@ class CompilationDatabase {
             return "[]";
         }
 
+        auto cwd = std::filesystem::current_path().string();
         std::string result = "[";
-        result += m_render_entry(db.begin()->second);
+        result += m_render_entry(db.begin()->second, cwd);
         for (auto entry = ++db.begin(); entry != db.end(); entry++) {
             result += ", ";
-            result += m_render_entry(entry->second);
+            result += m_render_entry(entry->second, cwd);
         }
         result += "]";
         return result;
     }
 
+    // Write `compile_commands.json`. The file is left untouched if it's already up to date.
+    void write() {
+        if (m_dummy) return;
+        auto db = generate_database() + '\n';
+        {
+            std::ifstream existing("compile_commands.json", std::ios::binary | std::ios::ate);
+            if (existing && static_cast<std::size_t>(existing.tellg()) == db.size()) {
+                std::string content(db.size(), '\0');
+                existing.seekg(0);
+                existing.read(content.data(), content.size());
+                if (content == db) return;
+            }
+        }
+        std::ofstream comp_db("compile_commands.json");
+        comp_db << db;
+    }
+
     void build() {
         perform();
+        write();
+    }
 
-        if (m_dummy) return;
-        auto db = generate_database();
-        std::ofstream comp_db("compile_commands.json");
-        comp_db << db << '\n';
+};
+
+// }}}
+
+// {{{ Include analysis
+
+// Cost of a header over translation units of a target.
+struct IncludeCost {
+    std::string header;
+    // Translation units including the header, directly or transitively.
+    std::size_t translation_units = 0;
+    // Lines the header brings into a translation unit together with everything it includes, on average.
+    std::uint64_t lines = 0;
+    // Lines parsed because of the header over all translation units.
+    std::uint64_t total_lines = 0;
+};
+
+// Parse the include tree printed by `-H` into `(depth, header)` pairs in order of inclusion.
+inline std::vector<std::pair<std::size_t, std::string>> parse_include_tree(std::string_view output) {
+    std::vector<std::pair<std::size_t, std::string>> result;
+    while (!output.empty()) {
+        auto eol = output.find('\n');
+        auto line = output.substr(0, eol);
+        output = eol == std::string_view::npos ? std::string_view {} : output.substr(eol + 1);
+
+        auto depth = line.find_first_not_of('.');
+        if (depth == 0 || depth == std::string_view::npos || line[depth] != ' ') continue;
+        result.emplace_back(depth, std::string(line.substr(depth + 1)));
+    }
+    return result;
+}
+
+// Include costs accumulated over translation units.
+class IncludeCostReport {
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::uint64_t> m_line_counts;
+    std::unordered_map<std::string, IncludeCost> m_costs;
+
+    std::uint64_t m_lines_of(const std::string& path) {
+        {
+            std::lock_guard lock(m_mutex);
+            if (auto it = m_line_counts.find(path); it != m_line_counts.end()) return it->second;
+        }
+        std::ifstream ifs(path, std::ios::binary);
+        std::uint64_t lines = 0;
+        std::string buffer(1 << 16, '\0');
+        while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount() > 0) {
+            lines += std::count(buffer.data(), buffer.data() + ifs.gcount(), '\n');
+        }
+        std::lock_guard lock(m_mutex);
+        m_line_counts[path] = lines;
+        return lines;
     }
 
+    public:
+    // Add include tree of one translation unit, as returned by `parse_include_tree`.
+    void add(const std::vector<std::pair<std::size_t, std::string>>& tree) {
+        // Walk backwards, so every header's children are summed up before it's reached.
+        std::vector<std::uint64_t> pending;
+        std::unordered_map<std::string, std::uint64_t> lines;
+        for (auto it = tree.rbegin(); it != tree.rend(); it++) {
+            auto& [depth, header] = *it;
+            if (pending.size() < depth + 2) pending.resize(depth + 2);
+            auto total = m_lines_of(header) + pending[depth + 1];
+            pending[depth + 1] = 0;
+            pending[depth] += total;
+            auto& entry = lines[header];
+            entry = std::max(entry, total);
+        }
+
+        std::lock_guard lock(m_mutex);
+        for (const auto& [header, total] : lines) {
+            auto& cost = m_costs[header];
+            cost.header = header;
+            cost.translation_units++;
+            cost.total_lines += total;
+        }
+    }
+
+    // Costs of every header seen, most expensive first.
+    std::vector<IncludeCost> costs() {
+        std::lock_guard lock(m_mutex);
+        std::vector<IncludeCost> result;
+        for (auto [header, cost] : m_costs) {
+            cost.lines = cost.total_lines / cost.translation_units;
+            result.push_back(std::move(cost));
+        }
+        std::sort(result.begin(), result.end(), [](const IncludeCost& a, const IncludeCost& b) {
+            return a.total_lines != b.total_lines ? a.total_lines > b.total_lines : a.header < b.header;
+        });
+        return result;
+    }
 };
 
+// Print `costs` as a table to stdout, at most `limit` rows.
+inline void print_include_costs(const std::vector<IncludeCost>& costs, std::size_t limit = 30) {
+    g_logger.flush();
+    std::cout << std::format("{:>6} {:>10} {:>14}  {}\n", "TUs", "Lines", "Total lines", "Header");
+    for (std::size_t i = 0; i < costs.size() && i < limit; i++) {
+        const auto& cost = costs[i];
+        std::cout << std::format("{:>6} {:>10} {:>14}  {}\n", cost.translation_units, cost.lines, cost.total_lines, cost.header);
+    }
+}
+
 // }}}
 
 // {{{ Structural Representation (facny stuff)
 
 // {{{ Target
 
+// Command generating files before a target is compiled, e.g. sources from a protobuf definition.
+struct CustomCommand {
+    std::vector<std::string> argv;
+    // Files the command reads, it reruns when any of them is newer than its outputs.
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+    // Makefile style depfile written by the command listing further inputs, empty if none.
+    std::string depfile;
+    // Name of the `JobPool` the command runs in, empty for none.
+    std::string pool;
+};
+
 // Class that represents a target.
 class Target {
     ArtifactType m_atype;
@@ -746,62 +3586,405 @@ class Target {
     std::vector<std::string> m_ldflags;
     std::filesystem::path m_build_dir;
     std::string m_target_name;
+    std::unordered_map<std::string, std::uint64_t> m_memory_weights;
+    std::vector<std::string> m_pgo_training;
+    LtoMode m_lto = LtoMode::None;
+    DebugOptions m_debug;
+    std::string m_variant;
+    // Artifacts of other targets this one is linked with, relinking when their content changes.
+    std::vector<std::string> m_link_inputs;
+    // Libraries of other targets passed to the linker after objects.
+    std::vector<std::string> m_link_libraries;
+    // Directory of objects shared with other targets, empty if objects are private.
+    std::filesystem::path m_object_store;
+    std::unordered_map<std::string, std::function<void(Target&)>> m_variants;
+    std::vector<CustomCommand> m_custom_commands;
+    // Headers to install, as pairs of source path and path relative to `<prefix>/include`.
+    std::vector<std::pair<std::string, std::string>> m_headers;
+
+    // Flags and inputs added on top of the target's own ones for a single build.
+    struct BuildOverlay {
+        std::vector<std::string> compile_flags;
+        std::vector<std::string> link_flags;
+        // Files every object depends on.
+        std::vector<std::string> inputs;
+        // Whether every object depends on a GCC profile (`.gcda`) next to it.
+        bool object_profiles = false;
+    };
 
-    // Generates object file name from a path.
-    // This generates a unique name for every path, and always generates same name for the same path.
-    std::string m_generate_obj_name(std::string_view path) {
-        std::string result;
-        for (auto ch : path) {
-            switch (ch) {
-                case '/': {
-                    result += "$P";
-                } break;
-                case '$': {
-                    result += "$$";
-                } break;
-                case '.': {
-                    result += "$d";
-                } break;
-                default: {
-                    result += ch;
-                } break;
+    // Build the instrumented variant, train it if it changed since last training, and add flags using the profile to `overlay`.
+    void m_apply_pgo(BuildOverlay& overlay) {
+        auto compiler = m_cxx_files.empty() ? get_cc() : get_cxx();
+        auto family = detect_compiler_family(compiler);
+        if (family == CompilerFamily::Unknown) {
+            throw std::runtime_error(std::format("PGO of target {} needs GCC or Clang, but {} is neither", m_target_name, compiler));
+        }
+        auto generate_flag = family == CompilerFamily::Clang ? "-fprofile-instr-generate" : "-fprofile-generate";
+
+        Target instrumented = *this;
+        instrumented.m_pgo_training.clear();
+        instrumented.m_object_store.clear();
+        instrumented.m_build_dir = m_build_dir / "pgo-instrumented";
+        instrumented.m_cflags.push_back(generate_flag);
+        instrumented.m_cxxflags.push_back(generate_flag);
+        instrumented.m_ldflags.push_back(generate_flag);
+        log("INFO", "Building instrumented variant of target {}", m_target_name);
+        CompilationDatabase instrumented_db(true, true);
+        instrumented.build(instrumented_db);
+
+        auto pgo_dir = m_build_dir / "pgo";
+        if (!g_stat_cache.get(pgo_dir).is_directory) {
+            std::filesystem::create_directories(pgo_dir);
+            g_stat_cache.invalidate(pgo_dir);
+        }
+        // For Clang the merged profile itself, for GCC a stamp written once profiles are in place.
+        auto profile = (pgo_dir / (family == CompilerFamily::Clang ? "merged.profdata" : "profile.stamp")).string();
+        auto instrumented_artifact = artifact_file_name(instrumented.get_build_artifact(), m_atype).string();
+        auto profile_stat = g_stat_cache.get(profile);
+        if (!profile_stat.exists || g_stat_cache.get(instrumented_artifact).mtime >= profile_stat.mtime) {
+            m_train(family, instrumented, instrumented_artifact, profile);
+        }
+
+        if (family == CompilerFamily::Clang) {
+            overlay.compile_flags.push_back("-fprofile-instr-use=" + profile);
+            overlay.inputs.push_back(profile);
+        } else {
+            overlay.compile_flags.insert(overlay.compile_flags.end(), { "-fprofile-use", "-Wno-missing-profile" });
+            overlay.object_profiles = true;
+        }
+    }
+
+    // Run training workload with the instrumented artifact and collect the profile into `profile`.
+    void m_train(CompilerFamily family, Target& instrumented, const std::string& instrumented_artifact, const std::string& profile) {
+        namespace fs = std::filesystem;
+        log("INFO", "Training target {}", m_target_name);
+        if (m_pgo_training.empty()) {
+            throw std::runtime_error(std::format("No training command for PGO of target {}", m_target_name));
+        }
+
+        auto raw_dir = m_build_dir / "pgo" / "raw";
+        auto instrumented_obj_dir = instrumented.get_build_dir() / "obj";
+        CommandOptions options;
+        if (family == CompilerFamily::Clang) {
+            fs::remove_all(raw_dir);
+            fs::create_directories(raw_dir);
+            options.env.push_back("LLVM_PROFILE_FILE=" + fs::absolute(raw_dir / "%p-%m.profraw").string());
+        } else {
+            // Counters add up across runs, start from zero.
+            for (const auto& entry : fs::directory_iterator(instrumented_obj_dir)) {
+                if (entry.path().extension() == ".gcda") fs::remove(entry.path());
+            }
+        }
+
+        std::vector<std::string> argv;
+        for (auto arg : m_pgo_training) {
+            for (auto pos = arg.find("{artifact}"); pos != std::string::npos; pos = arg.find("{artifact}", pos)) {
+                arg.replace(pos, 10, instrumented_artifact);
+                pos += instrumented_artifact.size();
             }
+            argv.push_back(arg);
+        }
+        auto result = execute_command(argv, false, {}, options);
+        if (result.ret_code != 0) {
+            throw std::runtime_error(std::format("Training workload of target {} failed", m_target_name));
+        }
+
+        if (family == CompilerFamily::Clang) {
+            auto profdata = std::getenv("LLVM_PROFDATA");
+            std::vector<std::string> merge { profdata ? profdata : "llvm-profdata", "merge", "-o", profile };
+            for (const auto& entry : fs::directory_iterator(raw_dir)) {
+                if (entry.path().extension() == ".profraw") merge.push_back(entry.path().string());
+            }
+            auto merged = execute_tool(merge, profile, false);
+            if (merged.ret_code != 0) {
+                throw std::runtime_error(std::format("Failed to merge profiles of target {}", m_target_name));
+            }
+        } else {
+            // GCC looks for `<object without .o>.gcda` next to the object being compiled.
+            auto obj_dir = m_build_dir / "obj";
+            for (const auto& entry : fs::directory_iterator(instrumented_obj_dir)) {
+                if (entry.path().extension() != ".gcda") continue;
+                auto dest = obj_dir / entry.path().filename();
+                fs::copy_file(entry.path(), dest, fs::copy_options::overwrite_existing);
+                g_stat_cache.invalidate(dest);
+            }
+            std::ofstream stamp(profile);
+            stamp << "PROFILE STAMP DONT TOUCH";
+        }
+        g_stat_cache.invalidate(profile);
+    }
+
+    // Add compile and link flags for LTO to `overlay`.
+    void m_apply_lto(BuildOverlay& overlay) {
+        auto compiler = m_cxx_files.empty() ? get_cc() : get_cxx();
+        auto jobs = std::to_string(get_max_jobs());
+        switch (detect_compiler_family(compiler)) {
+            case CompilerFamily::Clang: {
+                auto mode = m_lto == LtoMode::Thin ? "-flto=thin" : "-flto=full";
+                overlay.compile_flags.push_back(mode);
+                overlay.link_flags.push_back(mode);
+                if (m_lto != LtoMode::Thin) break;
+
+                overlay.link_flags.push_back("-flto-jobs=" + jobs);
+                auto cache_dir = (m_build_dir / "lto-cache").string();
+                #ifdef __MACH__
+                overlay.link_flags.push_back("-Wl,-cache_path_lto," + cache_dir);
+                #else
+                // Caching is a linker feature, lld is used unless another linker was chosen.
+                std::string linker = "lld";
+                for (const auto& flag : m_ldflags) {
+                    if (flag.starts_with("-fuse-ld=")) linker = flag.substr(9);
+                }
+                if (linker == "lld" || linker.ends_with("ld.lld")) {
+                    if (linker == "lld") overlay.link_flags.push_back("-fuse-ld=lld");
+                    overlay.link_flags.push_back("-Wl,--thinlto-cache-dir=" + cache_dir);
+                } else if (linker == "gold") {
+                    overlay.link_flags.push_back("-Wl,-plugin-opt,cache-dir=" + cache_dir);
+                } else {
+                    log("WARNING", "Linker {} of target {} has no known ThinLTO cache option", linker, m_target_name);
+                }
+                #endif
+            } break;
+
+            case CompilerFamily::GCC: {
+                if (m_lto == LtoMode::Thin) {
+                    log("DEBUG", "GCC has no ThinLTO, using partitioned LTO for target {}", m_target_name);
+                }
+                overlay.compile_flags.push_back("-flto");
+                overlay.link_flags.push_back("-flto=" + jobs);
+            } break;
+
+            default:
+                throw std::runtime_error(std::format("LTO of target {} needs GCC or Clang, but {} is neither", m_target_name, compiler));
         }
-        return result + ".o";
     }
 
-    public:
-    Target(const std::string& target_name = "program", const std::string& build_dir = "./build") : m_atype(ArtifactType::Executable), m_build_dir(build_dir), m_target_name(target_name) {}
+    // Built-in configuration of variant `name`, returns false if there's none.
+    static bool m_apply_preset_variant(Target& target, const std::string& name) {
+        auto sanitize = [&](std::string_view sanitizer) {
+            auto flag = std::format("-fsanitize={}", sanitizer);
+            target.debug().add_c_flags({ flag, "-fno-omit-frame-pointer" }).add_cxx_flags({ flag, "-fno-omit-frame-pointer" }).add_linker_flag(flag);
+        };
+        if (name == "debug") {
+            target.debug().set_optimization("0");
+        } else if (name == "release") {
+            target.set_optimization("2").add_c_flag("-DNDEBUG").add_cxx_flag("-DNDEBUG");
+        } else if (name == "asan") {
+            sanitize("address");
+        } else if (name == "ubsan") {
+            sanitize("undefined");
+        } else if (name == "tsan") {
+            sanitize("thread");
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Whether outputs of `command` exist, are newer than every input and were produced by the same command line.
+    bool m_is_up_to_date(const CustomCommand& command, BuildLog& build_log) {
+        auto oldest_output = std::numeric_limits<std::int64_t>::max();
+        for (const auto& output : command.outputs) {
+            auto output_stat = g_stat_cache.get(output);
+            if (!output_stat.exists) return false;
+            oldest_output = std::min(oldest_output, output_stat.mtime);
+        }
+        auto is_older = [&](const std::string& input) {
+            auto input_stat = g_stat_cache.get(input);
+            return input_stat.exists && input_stat.mtime < oldest_output;
+        };
+        if (!std::all_of(command.inputs.begin(), command.inputs.end(), is_older)) return false;
+        auto record = build_log.get(command.outputs[0]);
+        if (!record || record->input_hash != m_command_hash(command)) return false;
+        return build_log.all_deps(command.outputs[0], is_older);
+    }
+
+    static std::uint64_t m_command_hash(const CustomCommand& command) {
+        std::uint64_t hash = 0;
+        for (const auto& arg : command.argv) {
+            hash = hash_combine(hash, hash_bytes(arg));
+        }
+        return hash;
+    }
+
+    // Run `command` unless it's up to date, recording its command line and depfile into `build_log`.
+    void m_run_custom_command(const CustomCommand& command, BuildLog& build_log) {
+        if (m_is_up_to_date(command, build_log)) return;
+        log("INFO", "Generating {} for target {}", command.outputs[0], m_target_name);
+        for (const auto& output : command.outputs) {
+            auto parent = std::filesystem::path(output).parent_path();
+            if (!parent.empty()) std::filesystem::create_directories(parent);
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto result = execute_tool(command.argv, command.outputs[0], false);
+        for (const auto& output : command.outputs) {
+            g_stat_cache.invalidate(output);
+        }
+        if (result.ret_code != 0) {
+            if (!g_running_commands.cancelled()) log("ERROR", "Generating {} failed", command.outputs[0]);
+            throw std::runtime_error("Custom command failed");
+        }
+        build_log.update(command.outputs[0], [&](BuildRecord& record) {
+            record.set_usage(result.usage, elapsed_ms(start));
+            record.input_hash = m_command_hash(command);
+        });
+        if (!command.depfile.empty()) {
+            std::ifstream ifs(command.depfile);
+            std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+            build_log.set_deps(command.outputs[0], parse_depfile(content));
+        }
+    }
+
+    // Path of the object compiled from `src` with `flags`, without extension. Depfile and profile are next to it.
+    std::string m_object_base(const std::string& src, bool is_cxx, const std::vector<std::string>& flags, bool share_objects) {
+        auto obj_name = generate_obj_name(src);
+        auto stem = obj_name.substr(0, obj_name.size() - 2);
+        if (!share_objects) return (m_build_dir / "obj" / stem).string();
+
+        auto signature = hash_bytes(is_cxx ? get_cxx() : get_cc());
+        for (const auto& flag : flags) signature = hash_combine(signature, hash_bytes(flag));
+        for (const auto& flag : get_env_flags(is_cxx ? "CXXFLAGS" : "CFLAGS")) signature = hash_combine(signature, hash_bytes(flag));
+        signature = hash_combine(signature, hash_bytes(src));
+        return std::format("{}/{}-{:016x}", m_object_store.string(), stem, signature);
+    }
+
+    // Name of the target in messages, with the variant if any.
+    std::string m_display_name() const {
+        return m_variant.empty() ? m_target_name : std::format("{} ({})", m_target_name, m_variant);
+    }
+
+    // Annotated memory weight of `src`, 0 if unknown.
+    std::uint64_t m_memory_weight_of(const std::string& src) {
+        auto it = m_memory_weights.find(src);
+        return it == m_memory_weights.end() ? 0 : it->second;
+    }
+
+    public:
+    Target(const std::string& target_name = "program", const std::string& build_dir = "./build") : m_atype(ArtifactType::Executable), m_build_dir(build_dir), m_target_name(target_name) {}
+
+    // Set target type to executable.
+    Target& executable() {
+        m_atype = ArtifactType::Executable;
+        return *this;
+    }
+
+    // Set target type to static library.
+    Target& static_library() {
+        m_atype = ArtifactType::StaticLibrary;
+        return *this;
+    }
+
+    // Set target type to shared library.
+    Target& shared_library() {
+        m_atype = ArtifactType::SharedLibrary;
+        return *this;
+    }
+
+    // Add C source file.
+    Target& add_c_source(std::string_view src) {
+        log("DEBUG", "Adding C source {}", src);
+        m_c_files.push_back(std::string { src });
+        return *this;
+    }
+
+    // Add C++ source file.
+    Target& add_cxx_source(std::string_view src) {
+        log("DEBUG", "Adding C++ source {}", src);
+        m_cxx_files.push_back(std::string { src });
+        return *this;
+    }
+
+    // Annotate source `src` with its estimated peak compiler memory usage in bytes.
+    // Sources without annotation use the peak memory recorded by previous builds.
+    Target& set_memory_weight(std::string_view src, std::uint64_t bytes) {
+        m_memory_weights[std::string { src }] = bytes;
+        return *this;
+    }
+
+    // Enable profile-guided optimization.
+    // An instrumented variant is built into a separate build directory and `training_command` is run to collect a profile,
+    // which is then used to build the optimized artifact. `{artifact}` in arguments is replaced with the path of the
+    // instrumented artifact. Training only reruns when the instrumented artifact changes, and objects are only rebuilt
+    // when their sources or the profile change.
+    Target& pgo(std::vector<std::string> training_command) {
+        m_pgo_training = std::move(training_command);
+        return *this;
+    }
+
+    // Define build variant `name`, `configure` adds its flags on top of the target's own ones.
+    // Definitions replace built-in variants of the same name (`debug`, `release`, `asan`, `ubsan` and `tsan`).
+    Target& add_variant(const std::string& name, std::function<void(Target&)> configure) {
+        m_variants[name] = std::move(configure);
+        return *this;
+    }
+
+    // Copy of this target configured as variant `name`.
+    // Each variant has its own object and artifact directories under `<build dir>/variant/<name>`, so variants can be
+    // built side by side without rebuilding each other.
+    Target variant(const std::string& name) const {
+        Target result = *this;
+        result.m_variant = name;
+        result.m_build_dir = m_build_dir / "variant" / name;
+        if (auto it = m_variants.find(name); it != m_variants.end()) {
+            it->second(result);
+        } else if (!m_apply_preset_variant(result, name)) {
+            throw std::runtime_error(std::format("Target {} has no variant {}", m_target_name, name));
+        }
+        return result;
+    }
 
-    // Set target type to executable.
-    Target& executable() {
-        m_atype = ArtifactType::Executable;
-        return *this;
+    // Build variants `names` of this target one after another.
+    void build_variants(const std::vector<std::string>& names, CompilationDatabase& compdb) {
+        for (const auto& name : names) {
+            variant(name).build(compdb);
+        }
     }
 
-    // Set target type to static library.
-    Target& static_library() {
-        m_atype = ArtifactType::StaticLibrary;
-        return *this;
+    // Build variants `names` of this target one after another.
+    void build_variants(const std::vector<std::string>& names) {
+        CompilationDatabase db;
+        build_variants(names, db);
     }
 
-    // Set target type to shared library.
-    Target& shared_library() {
-        m_atype = ArtifactType::SharedLibrary;
+    // Link with the library built by `other`, which must be built before this target.
+    // This target is relinked only when content of the library changes, not when it's merely rebuilt.
+    // Libraries and linker flags needed by a static library are passed on to this target as well.
+    Target& link_target(const Target& other) {
+        auto file = artifact_file_name(other.m_build_dir / "dest" / other.m_target_name, other.m_atype).string();
+        switch (other.m_atype) {
+            case ArtifactType::StaticLibrary: {
+                m_link_libraries.push_back(file);
+                m_link_libraries.insert(m_link_libraries.end(), other.m_link_libraries.begin(), other.m_link_libraries.end());
+                m_link_inputs.insert(m_link_inputs.end(), other.m_link_inputs.begin(), other.m_link_inputs.end());
+                add_linker_flags(other.m_ldflags);
+            } break;
+
+            case ArtifactType::SharedLibrary: {
+                auto dir = std::filesystem::absolute(other.m_build_dir / "dest").string();
+                add_link_directory(dir).add_rpath(dir);
+                m_link_libraries.push_back("-l" + other.m_target_name);
+            } break;
+
+            default:
+                throw std::runtime_error(std::format("Target {} cannot link with executable {}", m_target_name, other.m_target_name));
+        }
+        m_link_inputs.push_back(file);
         return *this;
     }
 
-    // Add C source file.
-    Target& add_c_source(std::string_view src) {
-        log("INFO", "Adding C source {}", src);
-        m_c_files.push_back(std::string { src });
+    // Keep objects in `store` shared by every target using the same one, instead of the target's own object directory.
+    // Objects are named by their source and a hash of the whole compile command, so a source compiled with identical
+    // flags by several targets is compiled once and reused by all of them. Cleaning a target leaves the store alone.
+    Target& share_objects(std::filesystem::path store = "./build/objects") {
+        m_object_store = std::move(store);
         return *this;
     }
 
-    // Add C++ source file.
-    Target& add_cxx_source(std::string_view src) {
-        log("INFO", "Adding C++ source {}", src);
-        m_cxx_files.push_back(std::string { src });
+    // Enable link-time optimization.
+    // Link runs LTO backends on as many threads as jobs are allowed, and ThinLTO keeps a cache in the build directory so
+    // only changed modules are optimized again. Static libraries are archived with `llvm-ar` or `gcc-ar` accordingly.
+    Target& lto(LtoMode mode = LtoMode::Full) {
+        m_lto = mode;
         return *this;
     }
 
@@ -886,6 +4069,23 @@ class Target {
         return *this;
     }
 
+    // Enable debug information, with `options` making debug links cheaper.
+    Target& debug(DebugOptions options) {
+        debug();
+        if (options.dwp) options.split_dwarf = true;
+        std::vector<std::string> compile_flags;
+        if (options.split_dwarf) compile_flags.push_back("-gsplit-dwarf");
+        if (options.compress) {
+            compile_flags.push_back("-gz");
+            m_ldflags.push_back("-gz");
+        }
+        if (options.gdb_index) m_ldflags.push_back("-Wl,--gdb-index");
+        m_cflags.insert(m_cflags.end(), compile_flags.begin(), compile_flags.end());
+        m_cxxflags.insert(m_cxxflags.end(), compile_flags.begin(), compile_flags.end());
+        m_debug = options;
+        return *this;
+    }
+
     // Add include directory for C.
     Target& add_include_directory_c(std::string_view dir) {
         m_cflags.push_back(std::format("-I{}", dir));
@@ -919,8 +4119,8 @@ class Target {
 
     // Add runtime path.
     Target& add_rpath(std::string_view rpath) {
-        m_ldflags.push_back("-rpath");
-        m_ldflags.push_back(std::string { rpath });
+        // Linking goes through the compiler driver, which doesn't know `-rpath` itself.
+        m_ldflags.push_back(std::format("-Wl,-rpath,{}", rpath));
         return *this;
     }
 
@@ -959,6 +4159,46 @@ class Target {
         return *this;
     }
 
+    // Run `command` before compiling whenever its outputs are missing, older than its inputs (including those listed
+    // in its depfile) or were produced by another command line. C and C++ sources among its outputs are compiled into
+    // this target. If it generates headers, every compilation of the target waits for it.
+    Target& add_custom_command(CustomCommand command) {
+        if (command.argv.empty() || command.outputs.empty()) {
+            throw std::runtime_error(std::format("Custom command of target {} needs a command line and outputs", m_target_name));
+        }
+        for (const auto& output : command.outputs) {
+            if (is_cxx_source(output)) {
+                add_cxx_source(output);
+            } else if (is_c_source(output)) {
+                add_c_source(output);
+            }
+        }
+        m_custom_commands.push_back(std::move(command));
+        return *this;
+    }
+
+    // Add a header installed as `<prefix>/include/<dir>/<file name>` by `install`.
+    Target& add_header(std::string_view path, std::string_view dir = "") {
+        auto dest = std::filesystem::path(dir) / std::filesystem::path(path).filename();
+        m_headers.emplace_back(std::string { path }, dest.string());
+        return *this;
+    }
+
+    // Add all headers in a directory recursively, keeping their paths relative to `path` under `<prefix>/include/<dir>`.
+    Target& add_header_dir(std::string_view path, std::string_view dir = "") {
+        if (!std::filesystem::exists(path) || !std::filesystem::is_directory(path)) {
+            throw std::runtime_error(std::format("{} is not a valid directory. ", path));
+        }
+
+        for (auto entry : std::filesystem::recursive_directory_iterator(path, std::filesystem::directory_options::follow_directory_symlink)) {
+            if (entry.is_directory() || !is_cxx_header(entry.path().string())) continue;
+            auto dest = std::filesystem::path(dir) / std::filesystem::relative(entry.path(), path);
+            m_headers.emplace_back(entry.path().string(), dest.string());
+        }
+
+        return *this;
+    }
+
 #if ENABLE_FEATURE_PKG_CONFIG
     // Add a package from pkg-config for C sources.
     Target& add_package_c(std::string_view pkg) {
@@ -1013,6 +4253,93 @@ class Target {
     }
 #endif
 
+    // Objects of this target depending on any of `changed` (absolute, normalized paths), according to sources and header
+    // dependencies recorded by previous builds. Outputs of custom commands whose inputs changed count as changed too.
+    // Objects whose dependencies were never recorded are assumed affected, and so is every object if `everything` is set.
+    std::vector<std::string> affected_objects(const std::unordered_set<std::string>& changed_files, bool everything = false) {
+        bool share_objects = !m_object_store.empty() && m_pgo_training.empty();
+        BuildOverlay overlay;
+        if (share_objects && m_lto != LtoMode::None) {
+            m_apply_lto(overlay);
+        }
+        auto& object_log = share_objects ? get_build_log(m_object_store) : get_build_log(m_build_dir);
+        auto changed = changed_files;
+        auto is_changed = [&](const std::string& path) {
+            return changed.contains(std::filesystem::absolute(path).lexically_normal().string());
+        };
+
+        // Commands may consume outputs of each other, propagate until nothing changes, commands are few.
+        auto& command_log = get_build_log(m_build_dir);
+        std::vector<bool> command_affected(m_custom_commands.size());
+        for (bool progress = true; progress;) {
+            progress = false;
+            for (std::size_t i = 0; i < m_custom_commands.size(); i++) {
+                const auto& command = m_custom_commands[i];
+                if (command_affected[i]) continue;
+                bool affected = std::any_of(command.inputs.begin(), command.inputs.end(), is_changed)
+                    || !command_log.all_deps(command.outputs[0], [&](const std::string& dep) { return !is_changed(dep); });
+                if (!affected) continue;
+                command_affected[i] = true;
+                progress = true;
+                for (const auto& output : command.outputs) {
+                    changed.insert(std::filesystem::absolute(output).lexically_normal().string());
+                }
+            }
+        }
+
+        std::vector<std::string> result;
+        auto check = [&](const std::string& src, bool is_cxx) {
+            auto flags = is_cxx ? m_cxxflags : m_cflags;
+            flags.insert(flags.end(), overlay.compile_flags.begin(), overlay.compile_flags.end());
+            auto obj = m_object_base(src, is_cxx, flags, share_objects) + ".o";
+            bool affected = everything || is_changed(src);
+            if (!affected && !object_log.has_deps(obj)) {
+                log("WARNING", "Dependencies of {} are unknown, assuming it's affected", obj);
+                affected = true;
+            }
+            if (!affected) {
+                affected = !object_log.all_deps(obj, [&](const std::string& dep) { return !is_changed(dep); });
+            }
+            if (affected) result.push_back(obj);
+        };
+        for (const auto& src : m_cxx_files) check(src, true);
+        for (const auto& src : m_c_files) check(src, false);
+        return result;
+    }
+
+    // Measure how much every header costs to compile, ranked by lines parsed because of it over all translation units.
+    // Include trees are collected with the compiler's `-H` while only preprocessing, so nothing is built.
+    std::vector<IncludeCost> include_costs() {
+        IncludeCostReport report;
+        std::vector<Job> jobs;
+        auto add_job = [&](const std::string& src, bool is_cxx) {
+            Job job;
+            job.name = src;
+            job.action = [&, src, is_cxx] {
+                auto flags = is_cxx ? m_cxxflags : m_cflags;
+                flags.insert(flags.end(), { "-E", "-H" });
+                auto result = execute_command(generate_compilation_argv(is_cxx, src, "/dev/null", flags, false));
+                if (result.ret_code != 0) {
+                    log("WARNING", "Preprocessing {} failed, it's left out of include costs", src);
+                    return;
+                }
+                report.add(parse_include_tree(result.stderr_content));
+            };
+            jobs.push_back(std::move(job));
+        };
+        for (const auto& src : m_cxx_files) add_job(src, true);
+        for (const auto& src : m_c_files) add_job(src, false);
+
+        log("INFO", "Analyzing includes of target {}", m_display_name());
+        run_jobs(jobs);
+        return report.costs();
+    }
+
+    // Print the `limit` most expensive headers of this target, see `include_costs`.
+    void include_report(std::size_t limit = 30) {
+        print_include_costs(include_costs(), limit);
+    }
+
     // Start the build process.
     void build() {
         CompilationDatabase db;
@@ -1026,53 +4353,307 @@ class Target {
             log("WARNING", "Did you forget to call go_rebuild_urself? g_build_script_name doesn't detected. ");
         }
 
-        log("INFO", "Building target {}", m_target_name);
-        if (!std::filesystem::exists(m_build_dir)) {
-            std::filesystem::create_directories(m_build_dir);
-        }
+        log("INFO", "Building target {}", m_display_name());
 
-        if (!std::filesystem::exists(m_build_dir / "obj")) {
-            std::filesystem::create_directories(m_build_dir / "obj");
+        // Dummy file indicates build time, everything is rebuilt once the build script changes.
+        auto dummy = (m_build_dir / "dummy").string();
+        if (g_build_script_name != "\\/\\/" && g_stat_cache.exists(dummy) && is_newer(g_build_script_name, dummy)) {
+            log("INFO", "Build script changed detected");
+            clean();
         }
 
-        if (!std::filesystem::exists(get_build_artifact_dir())) {
-            std::filesystem::create_directories(get_build_artifact_dir());
+        auto obj_dir = m_build_dir / "obj";
+        // GCC profiles are looked up next to objects and differ between targets, such objects can't be shared.
+        bool share_objects = !m_object_store.empty() && m_pgo_training.empty();
+        for (const auto& dir : { m_build_dir, obj_dir, get_build_artifact_dir(), share_objects ? m_object_store : obj_dir }) {
+            if (!g_stat_cache.get(dir).is_directory) {
+                std::filesystem::create_directories(dir);
+                g_stat_cache.invalidate(dir);
+            }
         }
 
-        // Create dummy file to indicate build time.
-        if (!std::filesystem::exists(m_build_dir / "dummy")) {
-            std::ofstream ofs(m_build_dir / "dummy");
+        if (!g_stat_cache.exists(dummy)) {
+            std::ofstream ofs(dummy);
             ofs << "DUMMY FILE DONT TOUCH";
             ofs.close();
-        } else {
-            if (g_build_script_name != "\\/\\/" && is_newer(g_build_script_name, (m_build_dir / "dummy").string())) {
-                log("INFO", "Build script changed detected");
-                clean();
-            }
+            g_stat_cache.invalidate(dummy);
         }
 
+        BuildOverlay overlay;
+        if (m_lto != LtoMode::None) {
+            m_apply_lto(overlay);
+        }
+        if (!m_pgo_training.empty()) {
+            m_apply_pgo(overlay);
+        }
+        auto ldflags = m_ldflags;
+        ldflags.insert(ldflags.end(), overlay.link_flags.begin(), overlay.link_flags.end());
+
         // Compilation stage
         log("INFO", "Compiling target {}", m_target_name);
-        std::unordered_map<std::string, std::string> src_to_obj;
-        for (auto cxxsrc : m_cxx_files) {
-            src_to_obj[cxxsrc] = m_generate_obj_name(cxxsrc);
-            compdb.compile_cxx_source(cxxsrc, m_build_dir / "obj" / src_to_obj[cxxsrc], m_cxxflags, false);
+        auto& build_log = get_build_log(m_build_dir);
+        auto first_operation = compdb.size();
+        auto* object_log = share_objects ? &get_build_log(m_object_store) : &build_log;
+        std::vector<std::string> srcs;
+        std::vector<std::string> objs;
+        std::vector<std::string> dwos;
+        auto add_operation = [&](const std::string& src, bool is_cxx) {
+            auto flags = is_cxx ? m_cxxflags : m_cflags;
+            flags.insert(flags.end(), overlay.compile_flags.begin(), overlay.compile_flags.end());
+            auto obj_base = m_object_base(src, is_cxx, flags, share_objects);
+            auto obj = obj_base + ".o";
+            auto depfile = obj_base + ".d";
+            flags.insert(flags.end(), { "-MMD", "-MF", depfile });
+            if (is_cxx) {
+                compdb.compile_cxx_source(src, obj, flags, false);
+            } else {
+                compdb.compile_c_source(src, obj, flags, false);
+            }
+            compdb.set_last_operation_hints(m_memory_weight_of(src), object_log, depfile);
+            // With LTO, DWARF is only generated when linking.
+            if (m_debug.split_dwarf && m_lto == LtoMode::None) {
+                dwos.push_back(obj_base + ".dwo");
+                compdb.add_last_operation_output(dwos.back());
+            }
+            for (const auto& input : overlay.inputs) {
+                compdb.add_last_operation_input(input);
+            }
+            if (overlay.object_profiles) {
+                auto profile = obj_base + ".gcda";
+                if (g_stat_cache.exists(profile)) compdb.add_last_operation_input(profile);
+            }
+            srcs.push_back(src);
+            objs.push_back(obj);
+        };
+        for (const auto& cxxsrc : m_cxx_files) {
+            add_operation(cxxsrc, true);
+        }
+        for (const auto& csrc : m_c_files) {
+            add_operation(csrc, false);
+        }
+
+        auto artifact = artifact_file_name(get_build_artifact(), m_atype).string();
+        // Static libraries are not linked, so libraries they depend on don't matter to them.
+        auto link_inputs = m_atype == ArtifactType::StaticLibrary ? std::vector<std::string> {} : m_link_inputs;
+        // Shared libraries are tracked through their interface stubs, so this target isn't relinked when only their
+        // implementation changes.
+        for (auto& input : link_inputs) {
+            if (is_shared_library(input)) input = interface_stub_name(input);
+        }
+        auto is_artifact_up_to_date = [&](std::int64_t newest_input) {
+            auto artifact_stat = g_stat_cache.get(artifact);
+            if (!artifact_stat.exists) return false;
+            if (artifact_stat.mtime > newest_input) return true;
+            auto record = build_log.get(get_build_artifact().string());
+            return record && record->input_mtime >= newest_input;
+        };
+        auto newest_link_input = [&] {
+            std::int64_t newest = 0;
+            for (const auto& input : link_inputs) {
+                auto input_stat = g_stat_cache.get(input);
+                if (!input_stat.exists) {
+                    throw std::runtime_error(std::format("{} needed by target {} doesn't exist, was it built?", input, m_target_name));
+                }
+                newest = std::max(newest, input_stat.mtime);
+            }
+            return newest;
+        };
+
+        // Interface stub of a shared library was written from the current artifact.
+        bool write_stub = m_atype == ArtifactType::SharedLibrary;
+        auto stub = interface_stub_name(artifact);
+        auto is_stub_up_to_date = [&] {
+            if (!write_stub) return true;
+            auto record = build_log.get(stub);
+            return g_stat_cache.exists(stub) && record && record->input_mtime == g_stat_cache.get(artifact).mtime;
+        };
+
+        // The DWARF package is newer than the artifact and every `.dwo` in it.
+        bool package_dwarf = m_debug.dwp && m_atype != ArtifactType::StaticLibrary;
+        auto dwp = artifact + ".dwp";
+        auto is_dwp_up_to_date = [&] {
+            if (!package_dwarf) return true;
+            auto dwp_stat = g_stat_cache.get(dwp);
+            if (!dwp_stat.exists || dwp_stat.mtime <= g_stat_cache.get(artifact).mtime) return false;
+            return std::all_of(dwos.begin(), dwos.end(), [&](const std::string& dwo) {
+                return g_stat_cache.get(dwo).mtime < dwp_stat.mtime;
+            });
+        };
+
+        // Fast path for no-op builds, decided with cached stats only.
+        std::int64_t newest_object = 0;
+        auto custom_commands_up_to_date = std::all_of(m_custom_commands.begin(), m_custom_commands.end(), [&](const CustomCommand& command) {
+            return m_is_up_to_date(command, build_log);
+        });
+        if (custom_commands_up_to_date && compdb.is_up_to_date(first_operation, newest_object)
+            && is_artifact_up_to_date(std::max(newest_object, newest_link_input())) && is_stub_up_to_date() && is_dwp_up_to_date()) {
+            log("INFO", "Target {} is up to date", m_display_name());
+            compdb.write();
+            return;
+        }
+
+        // Custom commands run in parallel with compilations that don't need their outputs.
+        std::vector<Job> jobs;
+        std::vector<std::size_t> custom_jobs;
+        std::vector<std::size_t> header_generators;
+        std::unordered_map<std::string, std::size_t> generated_by;
+        for (const auto& command : m_custom_commands) {
+            Job job;
+            job.name = command.outputs[0];
+            job.pool = command.pool;
+            if (auto record = build_log.get(job.name)) {
+                job.predicted_duration = record->duration;
+                job.memory_weight = record->peak_memory;
+            }
+            job.action = [&] {
+                m_run_custom_command(command, build_log);
+            };
+            for (const auto& output : command.outputs) {
+                generated_by[output] = jobs.size();
+            }
+            if (std::any_of(command.outputs.begin(), command.outputs.end(), [](const std::string& output) { return is_cxx_header(output); })) {
+                header_generators.push_back(jobs.size());
+            }
+            custom_jobs.push_back(jobs.size());
+            jobs.push_back(std::move(job));
+        }
+        auto compile_jobs = compdb.schedule(jobs, first_operation);
+        for (std::size_t i = 0; i < compile_jobs.size(); i++) {
+            auto& deps = jobs[compile_jobs[i]].deps;
+            deps.insert(deps.end(), header_generators.begin(), header_generators.end());
+            if (auto it = generated_by.find(srcs[i]); it != generated_by.end()) deps.push_back(it->second);
         }
 
-        for (auto csrc : m_c_files) {
-            src_to_obj[csrc] = m_generate_obj_name(csrc);
-            compdb.compile_c_source(csrc, m_build_dir / "obj" / src_to_obj[csrc], m_cxxflags, false);
+        // Linking stage, runs once every object is ready.
+        Job link_job;
+        auto link_job_name = get_build_artifact().string();
+        link_job.name = link_job_name;
+        link_job.pool = "link";
+        link_job.deps = compile_jobs;
+        // Outputs of custom commands might be linked as well, e.g. linker scripts.
+        link_job.deps.insert(link_job.deps.end(), custom_jobs.begin(), custom_jobs.end());
+        if (auto record = build_log.get(link_job.name)) {
+            link_job.predicted_duration = record->duration;
+            link_job.memory_weight = record->peak_memory;
         }
+        link_job.action = [&] {
+            auto newest_input = newest_link_input();
+            for (const auto& obj : objs) {
+                newest_input = std::max(newest_input, g_stat_cache.get(obj).mtime);
+            }
+            if (is_artifact_up_to_date(newest_input)) return;
 
-        compdb.build();
+            // Early cutoff: objects recompiled into identical bytes don't need linking again.
+            std::uint64_t input_hash = 0;
+            for (const auto& flag : ldflags) {
+                input_hash = hash_combine(input_hash, hash_bytes(flag));
+            }
+            for (const auto& input : objs) {
+                input_hash = hash_combine(input_hash, build_log.file_hash(input));
+            }
+            for (const auto& input : link_inputs) {
+                input_hash = hash_combine(input_hash, build_log.file_hash(input));
+            }
+            auto record = build_log.get(link_job_name);
+            if (record && record->input_mtime && record->input_hash == input_hash && g_stat_cache.exists(artifact)) {
+                log("INFO", "Inputs of target {} didn't change, skipping linking", m_display_name());
+                build_log.update(link_job_name, [&](BuildRecord& record) {
+                    record.input_mtime = newest_input;
+                });
+                return;
+            }
 
-        // Linking stage
-        log("INFO", "Linking or archiving target {}", m_target_name);
-        std::vector<std::string> objs;
-        for (auto kv : src_to_obj) {
-            objs.push_back(m_build_dir / "obj" / kv.second);
+            log("INFO", "Linking or archiving target {}", m_target_name);
+            auto start = std::chrono::steady_clock::now();
+            ResourceUsage usage;
+            auto outer_usage = std::exchange(g_job_usage, &usage);
+            auto inputs = objs;
+            if (m_atype != ArtifactType::StaticLibrary) {
+                inputs.insert(inputs.end(), m_link_libraries.begin(), m_link_libraries.end());
+            }
+            try {
+                link_artifact(inputs, get_build_artifact(), ldflags, m_atype, !m_cxx_files.empty(), m_lto);
+            } catch (...) {
+                g_job_usage = outer_usage;
+                throw;
+            }
+            g_job_usage = outer_usage;
+            if (g_job_usage) g_job_usage->add(usage);
+            build_log.update(link_job_name, [&](BuildRecord& record) {
+                record.set_usage(usage, elapsed_ms(start));
+                record.input_hash = input_hash;
+                record.input_mtime = newest_input;
+            });
+        };
+        jobs.push_back(std::move(link_job));
+
+        auto link_job_idx = jobs.size() - 1;
+        if (write_stub) {
+            Job stub_job;
+            stub_job.name = stub;
+            stub_job.deps = { link_job_idx };
+            stub_job.action = [&] {
+                if (is_stub_up_to_date()) return;
+                write_interface_stub(artifact);
+                build_log.update(stub, [&](BuildRecord& record) {
+                    record.input_mtime = g_stat_cache.get(artifact).mtime;
+                });
+            };
+            jobs.push_back(std::move(stub_job));
+        }
+
+        // Packaging DWARF runs as its own step once the artifact is linked.
+        if (package_dwarf) {
+            Job dwp_job;
+            dwp_job.name = dwp;
+            dwp_job.pool = "link";
+            dwp_job.deps = { link_job_idx };
+            dwp_job.action = [&] {
+                if (is_dwp_up_to_date()) return;
+                log("INFO", "Packaging debug info of target {}", m_target_name);
+                package_split_dwarf(artifact);
+            };
+            jobs.push_back(std::move(dwp_job));
+        }
+
+        BuildSummary summary;
+        try {
+            summary = run_jobs(jobs);
+        } catch (...) {
+            build_log.save();
+            object_log->save();
+            throw;
+        }
+        build_log.save();
+        object_log->save();
+        compdb.write();
+        summary.print();
+    }
+
+    // Install the built artifact into `<prefix>/bin` (executables) or `<prefix>/lib` (libraries),
+    // and declared headers into `<prefix>/include`. Files already identical at the destination are left untouched,
+    // so their timestamps don't trigger rebuilds of dependents.
+    void install(std::string_view prefix) {
+        auto artifact = artifact_file_name(get_build_artifact(), m_atype);
+        if (!g_stat_cache.exists(artifact)) {
+            throw std::runtime_error(std::format("{} of target {} doesn't exist, was it built?", artifact.string(), m_display_name()));
+        }
+
+        std::filesystem::path root { prefix };
+        std::vector<std::pair<std::string, std::string>> files;
+        files.emplace_back(artifact.string(), (root / (m_atype == ArtifactType::Executable ? "bin" : "lib") / artifact.filename()).string());
+        for (const auto& [src, dest] : m_headers) {
+            files.emplace_back(src, (root / "include" / dest).string());
+        }
+
+        std::size_t installed = 0;
+        for (const auto& [src, dest] : files) {
+            if (install_file(src, dest)) {
+                log("INFO", "Installing {}", dest);
+                installed++;
+            }
         }
-        link_artifact(objs, get_build_artifact(), m_ldflags, m_atype, !m_cxx_files.empty());
+        log("INFO", "Installed target {} to {}: {} files updated, {} unchanged", m_display_name(), prefix, installed, files.size() - installed);
     }
 
     // Clean the build directory
@@ -1080,6 +4661,7 @@ class Target {
         log("INFO", "Cleaning target {}", m_target_name);
         if (std::filesystem::exists(m_build_dir))
             std::filesystem::remove_all(m_build_dir);
+        g_stat_cache.clear();
     }
 
     // Get build artifact (may not exist).
@@ -1112,6 +4694,21 @@ class Target {
         return m_ldflags;
     }
 
+    // Get variant name, empty unless this target was created by `variant`.
+    std::string get_variant() {
+        return m_variant;
+    }
+
+    // Get artifacts of other targets this target is linked with.
+    std::vector<std::string> get_link_inputs() {
+        return m_link_inputs;
+    }
+
+    // Get LTO mode.
+    LtoMode get_lto() {
+        return m_lto;
+    }
+
     // Get artifact type.
     ArtifactType get_artifact_type() {
         return m_atype;
@@ -1126,6 +4723,459 @@ class Target {
 
 // }}}
 
+// {{{ Project
+
+// Class that represents a project, a set of targets described lazily.
+// A target is only configured once it's needed, so building one target doesn't pay for configuring all the others.
+class Project {
+    struct Entry {
+        std::function<void(Target&)> configure;
+        std::unique_ptr<Target> target;
+        // Targets got through `get` while configuring this one, built before it.
+        std::vector<std::string> deps;
+        bool configuring = false;
+    };
+
+    std::filesystem::path m_build_dir;
+    std::unordered_map<std::string, Entry> m_entries;
+    // Target names in the order they were added.
+    std::vector<std::string> m_names;
+    // Targets being configured, innermost last.
+    std::vector<std::string> m_configuring;
+
+    Entry& m_entry(std::string_view name) {
+        auto it = m_entries.find(std::string { name });
+        if (it == m_entries.end()) {
+            std::string known;
+            for (const auto& known_name : m_names) {
+                known += known.empty() ? known_name : ", " + known_name;
+            }
+            throw std::runtime_error(std::format("No target named {}, known targets are: {}", name, known));
+        }
+        return it->second;
+    }
+
+    // Append `name` to `order` after every target it depends on.
+    void m_add_build_order(const std::string& name, std::vector<std::string>& order, std::unordered_set<std::string>& visited) {
+        if (!visited.insert(name).second) return;
+        for (const auto& dep : m_entry(name).deps) {
+            m_add_build_order(dep, order, visited);
+        }
+        order.push_back(name);
+    }
+
+    public:
+    // Target `name` is built in `<build_dir>/<name>`.
+    Project(const std::string& build_dir = "./build") : m_build_dir(build_dir) {}
+
+    // Describe target `name`. `configure` runs when the target is first needed, by `build` or by `get`.
+    Project& add(std::string_view name, std::function<void(Target&)> configure) {
+        std::string key { name };
+        if (m_entries.contains(key)) {
+            throw std::runtime_error(std::format("Target {} is defined twice", name));
+        }
+        m_entries[key].configure = std::move(configure);
+        m_names.push_back(key);
+        return *this;
+    }
+
+    // Get target `name`, configuring it if it isn't yet.
+    // Targets got while configuring another one are its dependencies, so e.g. `t.link_target(project.get("lib"))`
+    // makes `lib` build before `t`.
+    Target& get(std::string_view name) {
+        auto& entry = m_entry(name);
+        std::string key { name };
+        if (!m_configuring.empty()) {
+            auto& deps = m_entries[m_configuring.back()].deps;
+            if (std::find(deps.begin(), deps.end(), key) == deps.end()) deps.push_back(key);
+        }
+        if (entry.configuring) {
+            throw std::runtime_error(std::format("Target {} depends on itself", name));
+        }
+        if (entry.target) return *entry.target;
+
+        log("INFO", "Configuring target {}", name);
+        auto target = std::make_unique<Target>(key, (m_build_dir / key).string());
+        entry.configuring = true;
+        m_configuring.push_back(key);
+        try {
+            entry.configure(*target);
+        } catch (...) {
+            entry.configuring = false;
+            m_configuring.pop_back();
+            throw;
+        }
+        entry.configuring = false;
+        m_configuring.pop_back();
+        entry.target = std::move(target);
+        return *entry.target;
+    }
+
+    // Names of every target, in the order they were added.
+    std::vector<std::string> get_names() {
+        return m_names;
+    }
+
+    // Build targets in `goals` together with their dependencies, or every target if `goals` is empty.
+    void build(const std::vector<std::string>& goals, CompilationDatabase& compdb) {
+        std::vector<std::string> order;
+        std::unordered_set<std::string> visited;
+        for (const auto& goal : goals.empty() ? m_names : goals) {
+            get(goal);
+            m_add_build_order(goal, order, visited);
+        }
+        for (const auto& name : order) {
+            m_entry(name).target->build(compdb);
+        }
+    }
+
+    void build(const std::vector<std::string>& goals = {}) {
+        CompilationDatabase db;
+        build(goals, db);
+    }
+
+    // Build targets named by the command line, e.g. `./oinb -j8 server client`, see `parse_build_options`.
+    void build(int argc, char **argv) {
+        build(parse_build_options(argc, argv));
+    }
+};
+
+// }}}
+
+// {{{ Tests
+
+// Outcome of a single test.
+struct TestResult {
+    std::string name;
+    bool passed = false;
+    bool timed_out = false;
+    // Exit code of the test, or 128 plus the signal that killed it.
+    int exit_code = 0;
+    std::uint64_t duration = 0;
+    // Everything the test wrote to stdout and stderr.
+    std::string output;
+};
+
+// Which part of tests to run, from `OINBS_TEST_SHARD` formatted as `<index>/<count>` with `index` counting from 1.
+// Returns `{ 1, 1 }` when unset.
+inline std::pair<std::size_t, std::size_t> get_test_shard() {
+    auto shard = std::getenv("OINBS_TEST_SHARD");
+    if (!shard) return { 1, 1 };
+    std::size_t index = 0, count = 0;
+    if (std::sscanf(shard, "%zu/%zu", &index, &count) != 2 || !index || index > count) {
+        throw std::runtime_error(std::format("Invalid OINBS_TEST_SHARD {}, expected <index>/<count>", shard));
+    }
+    return { index, count };
+}
+
+// Test executables run concurrently, longest ones first based on previous runs.
+class TestSuite {
+    struct Test {
+        std::string name;
+        std::vector<std::string> argv;
+        std::optional<Target> target;
+        std::chrono::milliseconds timeout;
+    };
+
+    std::string m_name;
+    std::filesystem::path m_build_dir;
+    std::vector<Test> m_tests;
+    std::vector<TestResult> m_results;
+    std::chrono::milliseconds m_timeout { 0 };
+    std::size_t m_jobs = 0;
+    std::string m_junit_path;
+    std::string m_json_path;
+
+    static std::string m_xml_escape(std::string_view text) {
+        std::string result;
+        for (auto ch : text) {
+            switch (ch) {
+                case '<': result += "&lt;"; break;
+                case '>': result += "&gt;"; break;
+                case '&': result += "&amp;"; break;
+                case '"': result += "&quot;"; break;
+                default:
+                    // Control characters are not allowed in XML 1.0 at all.
+                    if (static_cast<unsigned char>(ch) >= 0x20 || ch == '\n' || ch == '\t') result += ch;
+            }
+        }
+        return result;
+    }
+
+    void m_write_junit() {
+        std::size_t failures = 0;
+        std::uint64_t total = 0;
+        for (const auto& result : m_results) {
+            failures += !result.passed;
+            total += result.duration;
+        }
+        std::ofstream ofs(m_junit_path);
+        ofs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+        ofs << std::format("<testsuite name=\"{}\" tests=\"{}\" failures=\"{}\" time=\"{:.3f}\">\n", m_xml_escape(m_name), m_results.size(), failures, total / 1000.0);
+        for (const auto& result : m_results) {
+            ofs << std::format("  <testcase name=\"{}\" classname=\"{}\" time=\"{:.3f}\"", m_xml_escape(result.name), m_xml_escape(m_name), result.duration / 1000.0);
+            if (result.passed) {
+                ofs << "/>\n";
+                continue;
+            }
+            auto message = result.timed_out ? std::string("timed out") : std::format("exit code {}", result.exit_code);
+            ofs << std::format(">\n    <failure message=\"{}\">{}</failure>\n  </testcase>\n", message, m_xml_escape(result.output));
+        }
+        ofs << "</testsuite>\n";
+    }
+
+    void m_write_json() {
+        std::ofstream ofs(m_json_path);
+        ofs << std::format("{{\"suite\": {}, \"tests\": [", json_string(m_name));
+        for (std::size_t i = 0; i < m_results.size(); i++) {
+            const auto& result = m_results[i];
+            ofs << std::format("{}\n  {{\"name\": {}, \"passed\": {}, \"timed_out\": {}, \"exit_code\": {}, \"duration_ms\": {}, \"output\": {}}}",
+                i ? "," : "", json_string(result.name), result.passed, result.timed_out, result.exit_code, result.duration, json_string(result.output));
+        }
+        ofs << "\n]}\n";
+    }
+
+    public:
+    // Durations of tests are remembered in the build log of `build_dir` to start long tests first.
+    explicit TestSuite(std::string name = "tests", std::filesystem::path build_dir = "./build") : m_name(std::move(name)), m_build_dir(std::move(build_dir)) {}
+
+    // Add a test built from `target` and run with `args`. `timeout` overrides the suite's one if set.
+    TestSuite& add_test(Target target, std::vector<std::string> args = {}, std::chrono::milliseconds timeout = {}) {
+        auto name = target.get_name();
+        args.insert(args.begin(), target.get_build_artifact().string());
+        m_tests.push_back({ std::move(name), std::move(args), std::move(target), timeout });
+        return *this;
+    }
+
+    // Add a test running command `argv`. `timeout` overrides the suite's one if set.
+    TestSuite& add_command(std::string name, std::vector<std::string> argv, std::chrono::milliseconds timeout = {}) {
+        m_tests.push_back({ std::move(name), std::move(argv), std::nullopt, timeout });
+        return *this;
+    }
+
+    // Kill tests running longer than `timeout` and count them as failed, 0 means no limit.
+    TestSuite& set_timeout(std::chrono::milliseconds timeout) {
+        m_timeout = timeout;
+        return *this;
+    }
+
+    // Run at most `jobs` tests at once, 0 means `get_max_jobs()`.
+    TestSuite& set_jobs(std::size_t jobs) {
+        m_jobs = jobs;
+        return *this;
+    }
+
+    // Write a JUnit XML report to `path` after running.
+    TestSuite& junit_report(std::string path) {
+        m_junit_path = std::move(path);
+        return *this;
+    }
+
+    // Write a JSON report to `path` after running.
+    TestSuite& json_report(std::string path) {
+        m_json_path = std::move(path);
+        return *this;
+    }
+
+    // Build and run tests of the shard selected by `OINBS_TEST_SHARD`. Returns whether all of them passed.
+    bool run() {
+        auto [shard, shard_count] = get_test_shard();
+        std::vector<Test*> tests;
+        for (std::size_t i = 0; i < m_tests.size(); i++) {
+            if (i % shard_count == shard - 1) tests.push_back(&m_tests[i]);
+        }
+        log("INFO", "Running {} of {} tests in suite {} (shard {}/{})", tests.size(), m_tests.size(), m_name, shard, shard_count);
+
+        CompilationDatabase compdb;
+        for (auto test : tests) {
+            if (test->target) test->target->build(compdb);
+        }
+
+        if (!g_stat_cache.get(m_build_dir).is_directory) {
+            std::filesystem::create_directories(m_build_dir);
+            g_stat_cache.invalidate(m_build_dir);
+        }
+        auto& build_log = get_build_log(m_build_dir);
+        m_results.assign(tests.size(), {});
+        std::vector<Job> jobs;
+        for (std::size_t i = 0; i < tests.size(); i++) {
+            auto key = std::format("test:{}:{}", m_name, tests[i]->name);
+            Job job;
+            job.name = tests[i]->name;
+            if (auto record = build_log.get(key)) {
+                job.predicted_duration = record->duration;
+                job.memory_weight = record->peak_memory;
+            }
+            job.action = [&, i, key] {
+                auto test = tests[i];
+                auto& result = m_results[i];
+                CommandOptions options;
+                options.timeout = test->timeout.count() ? test->timeout : m_timeout;
+                auto start = std::chrono::steady_clock::now();
+                auto output = execute_command(test->argv, true, {}, options);
+                result.name = test->name;
+                result.duration = elapsed_ms(start);
+                result.timed_out = output.timed_out;
+                result.exit_code = WIFSIGNALED(output.ret_code) ? 128 + WTERMSIG(output.ret_code) : WEXITSTATUS(output.ret_code);
+                result.passed = !output.timed_out && output.ret_code == 0;
+                result.output = std::move(output.stdout_content) + output.stderr_content;
+                build_log.update(key, [&](BuildRecord& record) {
+                    record.set_usage(output.usage, result.duration);
+                });
+
+                if (result.passed) {
+                    log("INFO", "Test {} passed in {} ms", result.name, result.duration);
+                } else {
+                    log("ERROR", "Test {} {} after {} ms", result.name, result.timed_out ? "timed out" : std::format("failed with exit code {}", result.exit_code), result.duration);
+                    g_logger.write(result.output.empty() || result.output.ends_with('\n') ? result.output : result.output + '\n');
+                }
+            };
+            jobs.push_back(std::move(job));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        run_jobs(jobs, m_jobs);
+        build_log.save();
+
+        auto failed = std::count_if(m_results.begin(), m_results.end(), [](const TestResult& result) { return !result.passed; });
+        log(failed ? "ERROR" : "INFO", "{} of {} tests passed in {} ms", m_results.size() - failed, m_results.size(), elapsed_ms(start));
+        if (!m_junit_path.empty()) m_write_junit();
+        if (!m_json_path.empty()) m_write_json();
+        return failed == 0;
+    }
+
+    // Names of tests whose executable is one of `artifacts` (absolute, normalized paths).
+    std::vector<std::string> tests_running(const std::unordered_set<std::string>& artifacts) {
+        std::vector<std::string> result;
+        for (const auto& test : m_tests) {
+            if (artifacts.contains(std::filesystem::absolute(test.argv[0]).lexically_normal().string())) result.push_back(test.name);
+        }
+        return result;
+    }
+
+    // Get name of the suite.
+    std::string get_name() {
+        return m_name;
+    }
+
+    // Results of the last `run`.
+    const std::vector<TestResult>& results() const {
+        return m_results;
+    }
+};
+
+// }}}
+
+// {{{ Queries
+
+// What a set of changed files affects.
+struct AffectedSet {
+    std::vector<std::string> objects;
+    std::vector<std::string> targets;
+    // Tests as `<suite>/<test>`.
+    std::vector<std::string> tests;
+};
+
+// Find objects, targets and tests affected by `changed_files`, without building anything.
+// Targets are affected through their objects or through targets they're linked with, and everything is affected
+// when the build script itself changed.
+inline AffectedSet find_affected(const std::vector<std::string>& changed_files, const std::vector<Target*>& targets, const std::vector<TestSuite*>& suites = {}) {
+    auto normalize = [](const std::filesystem::path& path) {
+        return std::filesystem::absolute(path).lexically_normal().string();
+    };
+    std::unordered_set<std::string> changed;
+    for (const auto& file : changed_files) {
+        changed.insert(normalize(file));
+    }
+    bool everything = !g_build_script_source.empty() && changed.contains(normalize(g_build_script_source));
+
+    AffectedSet result;
+    std::vector<bool> affected(targets.size());
+    std::vector<std::string> artifacts(targets.size());
+    for (std::size_t i = 0; i < targets.size(); i++) {
+        auto& target = *targets[i];
+        artifacts[i] = normalize(artifact_file_name(target.get_build_artifact(), target.get_artifact_type()));
+        auto objects = target.affected_objects(changed, everything);
+        affected[i] = !objects.empty();
+        result.objects.insert(result.objects.end(), objects.begin(), objects.end());
+    }
+
+    // Propagate through links until nothing changes, targets are few.
+    std::unordered_set<std::string> affected_artifacts;
+    for (bool progress = true; progress;) {
+        progress = false;
+        for (std::size_t i = 0; i < targets.size(); i++) {
+            if (affected[i]) {
+                progress |= affected_artifacts.insert(artifacts[i]).second;
+                continue;
+            }
+            for (const auto& input : targets[i]->get_link_inputs()) {
+                if (affected_artifacts.contains(normalize(input))) {
+                    affected[i] = true;
+                    progress = true;
+                    break;
+                }
+            }
+        }
+    }
+    for (std::size_t i = 0; i < targets.size(); i++) {
+        if (affected[i]) result.targets.push_back(targets[i]->get_name());
+    }
+
+    for (auto suite : suites) {
+        for (const auto& test : suite->tests_running(affected_artifacts)) {
+            result.tests.push_back(suite->get_name() + "/" + test);
+        }
+    }
+    std::sort(result.objects.begin(), result.objects.end());
+    result.objects.erase(std::unique(result.objects.begin(), result.objects.end()), result.objects.end());
+    return result;
+}
+
+// Answer a query if `argv` asks for one, returning false otherwise so the build script goes on building.
+// `query affected --changed-files=<file>` reads changed paths from `<file>` (one per line, `-` for stdin) and prints
+// affected objects, targets and tests to stdout as `object <path>`, `target <name>` and `test <suite>/<test>` lines.
+inline bool run_query(int argc, char **argv, const std::vector<Target*>& targets, const std::vector<TestSuite*>& suites = {}) {
+    if (argc < 2 || std::string_view(argv[1]) != "query") return false;
+    if (argc < 3 || std::string_view(argv[2]) != "affected") {
+        throw std::runtime_error("Unknown query, expected `query affected --changed-files=<file>`");
+    }
+
+    std::string list;
+    for (int i = 3; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg.starts_with("--changed-files=")) {
+            list = arg.substr(16);
+        } else {
+            throw std::runtime_error(std::format("Unknown query option {}", arg));
+        }
+    }
+    if (list.empty()) throw std::runtime_error("Query affected needs --changed-files=<file>");
+
+    std::vector<std::string> changed_files;
+    std::ifstream ifs;
+    if (list != "-") {
+        ifs.open(list);
+        if (!ifs) throw std::runtime_error(std::format("Cannot read {}", list));
+    }
+    std::istream& input = list == "-" ? std::cin : ifs;
+    std::string line;
+    while (std::getline(input, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) changed_files.push_back(line);
+    }
+
+    auto affected = find_affected(changed_files, targets, suites);
+    g_logger.flush();
+    for (const auto& object : affected.objects) std::cout << "object " << object << '\n';
+    for (const auto& target : affected.targets) std::cout << "target " << target << '\n';
+    for (const auto& test : affected.tests) std::cout << "test " << test << '\n';
+    std::cout.flush();
+    return true;
+}
+
+// }}}
+
 // }}}
 
 OINBS_NAMESPACE_END